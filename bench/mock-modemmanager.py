@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This file is part of Wys.
+#
+# Wys is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your
+# option) any later version.
+#
+# Wys is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+# License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Author: agent <agent@local>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+
+"""A scripted ModemManager for the Wys benchmarks.
+
+Exports a single modem with a Voice interface on the system bus, which
+should be a private one given by DBUS_SYSTEM_BUS_ADDRESS, and takes a
+number of incoming calls through ringing, active and terminated once
+a client has fetched the modem.  Prints "ready" once the ModemManager
+name is owned and exits when the last call has been deleted.
+"""
+
+import argparse
+import sys
+
+from gi.repository import Gio, GLib
+
+
+MM_SERVICE = 'org.freedesktop.ModemManager1'
+MM_PATH = '/org/freedesktop/ModemManager1'
+MODEM_PATH = MM_PATH + '/Modem/0'
+CALL_PATH = MM_PATH + '/Call/%u'
+
+IFACE_PROPERTIES = 'org.freedesktop.DBus.Properties'
+IFACE_OBJECT_MANAGER = 'org.freedesktop.DBus.ObjectManager'
+IFACE_MM = MM_SERVICE
+IFACE_MODEM = MM_SERVICE + '.Modem'
+IFACE_VOICE = MM_SERVICE + '.Modem.Voice'
+IFACE_CALL = MM_SERVICE + '.Call'
+
+# MMCallState, MMCallStateReason and MMCallDirection
+CALL_STATE_UNKNOWN = 0
+CALL_STATE_RINGING_IN = 3
+CALL_STATE_ACTIVE = 4
+CALL_STATE_TERMINATED = 7
+CALL_STATE_REASON_INCOMING_NEW = 2
+CALL_STATE_REASON_ACCEPTED = 3
+CALL_STATE_REASON_TERMINATED = 4
+CALL_DIRECTION_INCOMING = 1
+
+INTROSPECTION = '''
+<node>
+  <interface name="org.freedesktop.DBus.Properties">
+    <method name="Get">
+      <arg type="s" direction="in"/>
+      <arg type="s" direction="in"/>
+      <arg type="v" direction="out"/>
+    </method>
+    <method name="GetAll">
+      <arg type="s" direction="in"/>
+      <arg type="a{sv}" direction="out"/>
+    </method>
+    <method name="Set">
+      <arg type="s" direction="in"/>
+      <arg type="s" direction="in"/>
+      <arg type="v" direction="in"/>
+    </method>
+    <signal name="PropertiesChanged">
+      <arg type="s"/>
+      <arg type="a{sv}"/>
+      <arg type="as"/>
+    </signal>
+  </interface>
+  <interface name="org.freedesktop.DBus.ObjectManager">
+    <method name="GetManagedObjects">
+      <arg type="a{oa{sa{sv}}}" direction="out"/>
+    </method>
+    <signal name="InterfacesAdded">
+      <arg type="o"/>
+      <arg type="a{sa{sv}}"/>
+    </signal>
+    <signal name="InterfacesRemoved">
+      <arg type="o"/>
+      <arg type="as"/>
+    </signal>
+  </interface>
+  <interface name="org.freedesktop.ModemManager1">
+    <property name="Version" type="s" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.ModemManager1.Modem">
+    <property name="Device" type="s" access="read"/>
+    <property name="Manufacturer" type="s" access="read"/>
+    <property name="Model" type="s" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.ModemManager1.Modem.Voice">
+    <method name="ListCalls">
+      <arg type="ao" direction="out"/>
+    </method>
+    <signal name="CallAdded">
+      <arg type="o"/>
+    </signal>
+    <signal name="CallDeleted">
+      <arg type="o"/>
+    </signal>
+    <property name="Calls" type="ao" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.ModemManager1.Call">
+    <signal name="StateChanged">
+      <arg type="i"/>
+      <arg type="i"/>
+      <arg type="u"/>
+    </signal>
+    <property name="State" type="i" access="read"/>
+    <property name="StateReason" type="i" access="read"/>
+    <property name="Direction" type="i" access="read"/>
+    <property name="Number" type="s" access="read"/>
+  </interface>
+</node>
+'''
+
+NODE_INFO = Gio.DBusNodeInfo.new_for_xml(INTROSPECTION)
+
+
+class MockObject:
+    """An object with properties on some of the interfaces above"""
+
+    def __init__(self, connection, path, properties, methods=None):
+        self.connection = connection
+        self.path = path
+        self.properties = properties
+        self.methods = methods or {}
+        self.ids = []
+
+        interfaces = {IFACE_PROPERTIES} | set(properties)
+        interfaces |= {interface for interface, method in self.methods}
+        for name in sorted(interfaces):
+            info = NODE_INFO.lookup_interface(name)
+            self.ids.append(connection.register_object(
+                path, info, self.method_call, None, None))
+
+    def unregister(self):
+        for id in self.ids:
+            self.connection.unregister_object(id)
+        self.ids = []
+
+    def method_call(self, connection, sender, path, interface, method,
+                    parameters, invocation):
+        if interface == IFACE_PROPERTIES and method == 'Get':
+            iface, name = parameters.unpack()
+            value = self.properties.get(iface, {}).get(name)
+            if value is None:
+                invocation.return_dbus_error(
+                    'org.freedesktop.DBus.Error.UnknownProperty', name)
+                return
+            invocation.return_value(GLib.Variant('(v)', (value,)))
+        elif interface == IFACE_PROPERTIES and method == 'GetAll':
+            iface, = parameters.unpack()
+            invocation.return_value(
+                GLib.Variant('(a{sv})', (self.properties.get(iface, {}),)))
+        elif (interface, method) in self.methods:
+            invocation.return_value(self.methods[(interface, method)]())
+        else:
+            invocation.return_dbus_error(
+                'org.freedesktop.DBus.Error.UnknownMethod', method)
+
+    def set(self, interface, name, value):
+        self.properties[interface][name] = value
+        self.emit(IFACE_PROPERTIES, 'PropertiesChanged',
+                  GLib.Variant('(sa{sv}as)', (interface, {name: value}, [])))
+
+    def emit(self, interface, signal, parameters):
+        self.connection.emit_signal(None, self.path, interface, signal,
+                                    parameters)
+
+
+class MockModemManager:
+    def __init__(self, connection, args):
+        self.connection = connection
+        self.args = args
+        self.loop = GLib.MainLoop()
+        self.calls = []
+        self.calls_done = 0
+        self.started = False
+        self.timeout_id = GLib.timeout_add_seconds(args.timeout, self.timeout)
+
+        self.manager = MockObject(
+            connection, MM_PATH,
+            {IFACE_MM: {'Version': GLib.Variant('s', '1.14.0-wys-bench')}},
+            {(IFACE_OBJECT_MANAGER, 'GetManagedObjects'):
+             self.get_managed_objects})
+        self.modem = MockObject(
+            connection, MODEM_PATH,
+            {IFACE_MODEM: {
+                'Device': GLib.Variant('s', args.device),
+                'Manufacturer': GLib.Variant('s', 'Wys'),
+                'Model': GLib.Variant('s', 'Benchmark modem')},
+             IFACE_VOICE: {'Calls': GLib.Variant('ao', [])}},
+            {(IFACE_VOICE, 'ListCalls'): self.list_calls})
+
+    def call_paths(self):
+        return [call.path for call in self.calls]
+
+    def get_managed_objects(self):
+        if not self.started:
+            # The client has the modem; give it time to set up its
+            # Voice proxy and PulseAudio before the first call
+            self.started = True
+            GLib.source_remove(self.timeout_id)
+            GLib.timeout_add(self.args.settle, self.add_call)
+        return GLib.Variant('(a{oa{sa{sv}}})',
+                            ({MODEM_PATH: self.modem.properties},))
+
+    def list_calls(self):
+        return GLib.Variant('(ao)', (self.call_paths(),))
+
+    def set_calls_property(self):
+        self.modem.set(IFACE_VOICE, 'Calls',
+                       GLib.Variant('ao', self.call_paths()))
+
+    def set_call_state(self, call, state, reason):
+        old = call.properties[IFACE_CALL]['State'].unpack()
+        call.properties[IFACE_CALL]['StateReason'] = GLib.Variant('i', reason)
+        call.set(IFACE_CALL, 'State', GLib.Variant('i', state))
+        call.emit(IFACE_CALL, 'StateChanged',
+                  GLib.Variant('(iiu)', (old, state, reason)))
+
+    def add_call(self):
+        path = CALL_PATH % (self.calls_done + 1)
+        call = MockObject(
+            self.connection, path,
+            {IFACE_CALL: {
+                'State': GLib.Variant('i', CALL_STATE_UNKNOWN),
+                'StateReason': GLib.Variant('i', 0),
+                'Direction': GLib.Variant('i', CALL_DIRECTION_INCOMING),
+                'Number': GLib.Variant('s', '+15555550100')}})
+        self.calls.append(call)
+        self.set_call_state(call, CALL_STATE_RINGING_IN,
+                            CALL_STATE_REASON_INCOMING_NEW)
+
+        self.modem.emit(IFACE_VOICE, 'CallAdded', GLib.Variant('(o)', (path,)))
+        self.set_calls_property()
+
+        GLib.timeout_add(self.args.ring, self.answer_call, call)
+        return GLib.SOURCE_REMOVE
+
+    def answer_call(self, call):
+        self.set_call_state(call, CALL_STATE_ACTIVE,
+                            CALL_STATE_REASON_ACCEPTED)
+        GLib.timeout_add(self.args.active, self.hang_up_call, call)
+        return GLib.SOURCE_REMOVE
+
+    def hang_up_call(self, call):
+        self.set_call_state(call, CALL_STATE_TERMINATED,
+                            CALL_STATE_REASON_TERMINATED)
+        GLib.timeout_add(self.args.gap, self.delete_call, call)
+        return GLib.SOURCE_REMOVE
+
+    def delete_call(self, call):
+        self.calls.remove(call)
+        self.modem.emit(IFACE_VOICE, 'CallDeleted',
+                        GLib.Variant('(o)', (call.path,)))
+        self.set_calls_property()
+        call.unregister()
+
+        self.calls_done += 1
+        if self.calls_done < self.args.calls:
+            self.add_call()
+        else:
+            self.loop.quit()
+        return GLib.SOURCE_REMOVE
+
+    def timeout(self):
+        self.timeout_id = 0
+        print('Timed out waiting for a client to fetch the modem',
+              file=sys.stderr)
+        self.loop.quit()
+        return GLib.SOURCE_REMOVE
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--calls', type=int, default=20,
+                        help='number of calls to take (default 20)')
+    parser.add_argument('--settle', type=int, default=1000, metavar='MSEC',
+                        help='delay before the first call (default 1000)')
+    parser.add_argument('--ring', type=int, default=200, metavar='MSEC',
+                        help='time each call rings (default 200)')
+    parser.add_argument('--active', type=int, default=1000, metavar='MSEC',
+                        help='time each call is active (default 1000)')
+    parser.add_argument('--gap', type=int, default=1000, metavar='MSEC',
+                        help='time between calls (default 1000)')
+    parser.add_argument('--timeout', type=int, default=30, metavar='SEC',
+                        help='time to wait for a client (default 30)')
+    parser.add_argument('--device', default='/sys/devices/wys-bench/modem0',
+                        help='the modem\'s Device property')
+    args = parser.parse_args()
+
+    connection = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+    mm = MockModemManager(connection, args)
+
+    reply = connection.call_sync(
+        'org.freedesktop.DBus', '/org/freedesktop/DBus',
+        'org.freedesktop.DBus', 'RequestName',
+        GLib.Variant('(su)', (MM_SERVICE, 0x4)),
+        GLib.VariantType('(u)'), Gio.DBusCallFlags.NONE, -1, None)
+    if reply.unpack()[0] != 1:
+        print('Could not own ' + MM_SERVICE, file=sys.stderr)
+        return 1
+
+    print('ready', flush=True)
+
+    mm.loop.run()
+
+    return 0 if mm.started else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
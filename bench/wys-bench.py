@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This file is part of Wys.
+#
+# Wys is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your
+# option) any later version.
+#
+# Wys is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+# License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Author: agent <agent@local>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+
+"""Measure Wys's call audio setup and teardown latency.
+
+Starts a private PulseAudio with null devices standing in for the
+modem, a private D-Bus system bus with the mock ModemManager from
+mock-modemmanager.py, and the wys binary under test with --stats.
+Once the mock has taken its calls, wys is stopped and the latency
+percentiles from its statistics file are reported.
+
+With --graph-sizes, this is repeated with the PulseAudio graph filled
+with each given number of unrelated sinks, sources and loopback
+streams between them, to show how discovery and setup scale with it.
+"""
+
+import argparse
+import configparser
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+
+MODEM_CARD = 'Modem'
+MODEM_PROPERTIES = ('device.class=sound device.api=alsa'
+                    ' alsa.card_name=' + MODEM_CARD)
+
+# The statistics file's groups, in the order they are reported
+STAGES = ['wait', 'discover', 'device', 'load', 'stream', 'setup',
+          'unload', 'teardown']
+COLUMNS = ['count', 'min', 'p50', 'p90', 'p99', 'max', 'mean']
+# The statistics file's "graph" keys
+GRAPH_KEYS = ['sinks', 'sources', 'modules', 'sink-inputs',
+              'source-outputs', 'cards']
+# The stages and percentiles compared across graph sizes
+SCALING_STAGES = ['discover', 'device', 'setup']
+SCALING_COLUMNS = ['p50', 'p90', 'p99']
+
+
+class BenchError(Exception):
+    pass
+
+
+def wait_for(what, condition, process, timeout=10.0):
+    deadline = time.monotonic() + timeout
+    while not condition():
+        if process.poll() is not None:
+            raise BenchError('%s exited with status %d'
+                             % (what, process.returncode))
+        if time.monotonic() > deadline:
+            raise BenchError('Timed out waiting for ' + what)
+        time.sleep(0.05)
+
+
+def pulseaudio_script(socket, graph_size):
+    """The server's start-up script, with graph_size unrelated sinks,
+    sources and loopback modules, each giving a sink input and a source
+    output, alongside the modem's and the phone's own devices"""
+    script = [
+        'load-module module-native-protocol-unix auth-anonymous=1'
+        ' socket=' + socket,
+        'load-module module-null-sink sink_name=modem_sink'
+        ' sink_properties="%s"' % MODEM_PROPERTIES,
+        'load-module module-null-source source_name=modem_source'
+        ' source_properties="%s"' % MODEM_PROPERTIES,
+        'load-module module-null-sink sink_name=speaker',
+        'load-module module-null-source source_name=mic',
+        'set-default-sink speaker',
+        'set-default-source mic',
+    ]
+
+    for i in range(graph_size):
+        script += [
+            'load-module module-null-sink sink_name=busy_sink%d' % i,
+            'load-module module-null-source source_name=busy_source%d' % i,
+            'load-module module-loopback source=busy_source%d'
+            ' sink=busy_sink%d' % (i, i),
+        ]
+
+    return script
+
+
+def start_pulseaudio(args, tmpdir, graph_size, processes):
+    runtime = os.path.join(tmpdir, 'pulse')
+    os.mkdir(runtime, 0o700)
+    socket = os.path.join(runtime, 'native')
+
+    script = os.path.join(tmpdir, 'default.pa')
+    with open(script, 'w') as f:
+        f.write('\n'.join(pulseaudio_script(socket, graph_size)) + '\n')
+
+    env = dict(os.environ,
+               HOME=tmpdir,
+               PULSE_RUNTIME_PATH=runtime,
+               PULSE_STATE_PATH=os.path.join(tmpdir, 'pulse-state'))
+    process = subprocess.Popen(
+        [args.pulseaudio, '-n', '--daemonize=no', '--exit-idle-time=-1',
+         '--use-pid-file=no', '--system=no', '-F', script],
+        env=env, stdout=subprocess.DEVNULL)
+    processes.append(process)
+
+    # Loading a big graph takes a while
+    wait_for('PulseAudio', lambda: os.path.exists(socket), process,
+             10.0 + graph_size / 10.0)
+    return 'unix:' + socket
+
+
+def start_bus(args, tmpdir, processes):
+    socket = os.path.join(tmpdir, 'system_bus_socket')
+    process = subprocess.Popen(
+        [args.dbus_daemon, '--session', '--nofork', '--nosyslog',
+         '--address=unix:path=' + socket],
+        stdout=subprocess.DEVNULL)
+    processes.append(process)
+
+    wait_for('dbus-daemon', lambda: os.path.exists(socket), process)
+    return 'unix:path=' + socket
+
+
+def start_mock(args, bus, processes):
+    mock = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'mock-modemmanager.py')
+    env = dict(os.environ, DBUS_SYSTEM_BUS_ADDRESS=bus)
+    process = subprocess.Popen(
+        [sys.executable, mock, '--calls', str(args.calls),
+         '--active', str(args.active), '--gap', str(args.gap)],
+        env=env, stdout=subprocess.PIPE, universal_newlines=True)
+    processes.append(process)
+
+    if process.stdout.readline().strip() != 'ready':
+        process.wait()
+        raise BenchError('The mock ModemManager did not start')
+    return process
+
+
+def start_wys(args, pulse, bus, stats, processes):
+    env = {key: value for key, value in os.environ.items()
+           if not key.startswith('WYS_')}
+    env.update(PULSE_SERVER=pulse, DBUS_SYSTEM_BUS_ADDRESS=bus)
+    process = subprocess.Popen(
+        [args.wys, '--modem', MODEM_CARD, '--hold-grace', '0',
+         '--stats', stats] + args.wys_args,
+        env=env, stdout=subprocess.DEVNULL)
+    processes.append(process)
+    return process
+
+
+def stop(process, timeout=10.0):
+    if process.poll() is not None:
+        return
+    process.send_signal(signal.SIGTERM)
+    try:
+        process.wait(timeout)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        process.wait()
+
+
+def run(args, tmpdir, graph_size):
+    """Run wys through the mock's calls once and return its statistics"""
+    processes = []
+    stats = os.path.join(tmpdir, 'stats.ini')
+
+    try:
+        pulse = start_pulseaudio(args, tmpdir, graph_size, processes)
+        bus = start_bus(args, tmpdir, processes)
+        mock = start_mock(args, bus, processes)
+        wys = start_wys(args, pulse, bus, stats, processes)
+
+        timeout = (args.calls * (args.active + args.gap + 200) / 1000.0
+                   + 60.0)
+        try:
+            mock.wait(timeout)
+        except subprocess.TimeoutExpired:
+            raise BenchError('Timed out waiting for the calls to finish')
+        if mock.returncode != 0:
+            raise BenchError('The mock ModemManager failed')
+        if wys.poll() is not None:
+            raise BenchError('wys exited with status %d' % wys.returncode)
+
+        # Stopping wys writes the statistics file
+        stop(wys)
+    finally:
+        for process in reversed(processes):
+            stop(process)
+
+    if not os.path.exists(stats):
+        raise BenchError('wys did not write its statistics')
+
+    parser = configparser.ConfigParser()
+    parser.read(stats)
+    return parser
+
+
+def report(stats, calls):
+    if stats.has_section('graph'):
+        print('graph: ' + ', '.join(
+            '%s %s' % (stats.get('graph', key, fallback='-'), key)
+            for key in GRAPH_KEYS))
+
+    print('%-10s' % 'ms' + ''.join('%8s' % column for column in COLUMNS))
+    for stage in STAGES:
+        if not stats.has_section(stage):
+            continue
+        values = stats[stage]
+        print('%-10s' % stage
+              + ''.join('%8s' % values.get(column, '-')
+                        for column in COLUMNS[:-1])
+              + '%8.1f' % float(values.get('mean', 'nan')))
+
+    # Each call sets up and tears down both directions
+    for stage in ('setup', 'teardown'):
+        count = stats.getint(stage, 'count', fallback=0)
+        if count < 2 * calls:
+            print('Only %d of %d loopback %ss were measured'
+                  % (count, 2 * calls, stage), file=sys.stderr)
+            return False
+    return True
+
+
+def report_scaling(results):
+    """Compare the stages across graph sizes, one row per size"""
+    print('%8s' % 'N' + ''.join('%16s' % ('%s %s' % (stage, column))
+                                for stage in SCALING_STAGES
+                                for column in SCALING_COLUMNS))
+    for graph_size, stats in results:
+        print('%8d' % graph_size
+              + ''.join('%16s' % stats.get(stage, column, fallback='-')
+                        for stage in SCALING_STAGES
+                        for column in SCALING_COLUMNS))
+
+
+def graph_sizes(value):
+    try:
+        sizes = [int(size) for size in value.split(',')]
+    except ValueError:
+        sizes = []
+    if not sizes or min(sizes) < 0:
+        raise argparse.ArgumentTypeError(
+            'expected a comma-separated list of graph sizes')
+    return sizes
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--wys', required=True,
+                        help='the wys binary to measure')
+    parser.add_argument('--pulseaudio', default='pulseaudio',
+                        help='the PulseAudio daemon to run')
+    parser.add_argument('--dbus-daemon', default='dbus-daemon',
+                        help='the D-Bus daemon to run')
+    parser.add_argument('--calls', type=int, default=20,
+                        help='number of calls to take (default 20)')
+    parser.add_argument('--active', type=int, default=1000, metavar='MSEC',
+                        help='time each call is active (default 1000)')
+    parser.add_argument('--gap', type=int, default=1000, metavar='MSEC',
+                        help='time between calls (default 1000)')
+    parser.add_argument('--graph-sizes', type=graph_sizes, default=[0],
+                        metavar='N,...',
+                        help='numbers of unrelated sinks, sources and'
+                        ' streams to run with (default 0)')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the temporary directory')
+    parser.add_argument('wys_args', nargs='*', metavar='WYS-ARG',
+                        help='further arguments for wys, after --')
+    args = parser.parse_args()
+
+    tmpdir = tempfile.mkdtemp(prefix='wys-bench-')
+    results = []
+    ok = True
+    try:
+        for graph_size in args.graph_sizes:
+            rundir = os.path.join(tmpdir, str(graph_size))
+            os.mkdir(rundir)
+
+            if len(args.graph_sizes) > 1:
+                print('== %d unrelated sinks, sources and streams =='
+                      % graph_size)
+            stats = run(args, rundir, graph_size)
+            ok = report(stats, args.calls) and ok
+            results.append((graph_size, stats))
+            print()
+
+        if len(results) > 1:
+            report_scaling(results)
+    except (BenchError, OSError) as e:
+        print(e, file=sys.stderr)
+        ok = False
+    finally:
+        if args.keep:
+            print('Files kept in ' + tmpdir, file=sys.stderr)
+        else:
+            shutil.rmtree(tmpdir, ignore_errors=True)
+
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
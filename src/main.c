@@ -24,6 +24,9 @@
 
 #include "wys-modem.h"
 #include "wys-audio.h"
+#include "wys-flight.h"
+#include "wys-sysfs.h"
+#include "wys-trace.h"
 #include "util.h"
 #include "config.h"
 #include "mchk-machine-check.h"
@@ -32,6 +35,7 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gio/gunixinputstream.h>
 
 #include <pulse/pulseaudio.h>
@@ -48,64 +52,497 @@
 #define TTY_CHUNK_SIZE   320
 #define SAMPLE_LEN       2
 
+/** Default time to keep the loopbacks after audio goes away, to
+    ride over holds and swaps between calls */
+#define DEFAULT_HOLD_GRACE_MSEC 500
+#define DEFAULT_LATENCY_MIN_MSEC 10
+#define DEFAULT_LATENCY_MAX_MSEC 100
+/** Default number of trace events to make room for */
+#define DEFAULT_TRACE_EVENTS 65536
+
 static GMainLoop *main_loop = NULL;
 
-struct wys_data
+struct wys_data;
+
+/** Call audio routing for one modem ALSA card.  Each route has its
+    own PulseAudio connection and loopbacks, so setting up one modem's
+    audio never waits on another's. */
+struct route
 {
+  struct wys_data *data;
+  /** The modem's ALSA card name, or NULL to use the card the
+      PulseAudio interface detects */
+  gchar *alsa_card;
   /** PulseAudio interface */
   WysAudio *audio;
+  /** Map of D-Bus object paths to the WysModems routed here */
+  GHashTable *modems;
+  /** How many of those modems have audio, in each direction */
+  guint audio_count[2];
+  /** Source IDs of pending loopback removals, in each direction */
+  guint grace_ids[2];
+};
+
+struct wys_data
+{
+  /** Routes, one for each modem ALSA card */
+  GPtrArray *routes;
+  /** The route for modems with no card of their own, or NULL while
+      there are none */
+  struct route *default_route;
+  /** The default modem ALSA card, or NULL to detect it */
+  const gchar *modem;
+  /** Loopback settings for each route's PulseAudio interface */
+  gboolean standby;
+  const struct wys_audio_profile *profile;
+  /** Map of modem device paths to ALSA card names, or NULL */
+  GHashTable *modem_cards;
+  /** Map of modem device paths to the ALSA card names found under
+      them in sysfs */
+  GHashTable *matched_cards;
   /** ID for the D-Bus watch */
   guint watch_id;
   /** ModemManager object proxy */
   MMManager *mm;
-  /** Map of D-Bus object paths to WysModems */
+  /** Whether we're adding the objects ModemManager already has */
+  gboolean adding_mm_objects;
+  /** Map of D-Bus object paths to the struct route each modem
+      belongs to */
   GHashTable *modems;
-  /** How many modems have audio, in each direction */
-  guint audio_count[2];
+  /** Whether the modems track calls without call proxies */
+  gboolean lean_calls;
+  /** How long to wait after audio goes away before removing the
+      loopback, in milliseconds */
+  guint hold_grace;
+  /** Monotonic time at which we started setting up */
+  gint64 start_time;
+  /** Monotonic times at which PulseAudio and ModemManager became
+      ready, or 0 */
+  gint64 audio_ready_time;
+  gint64 mm_ready_time;
+  /** Source ID of the SIGUSR1 handler that logs statistics, the
+      flight recorder and the modems' calls */
+  guint stats_id;
+  /** File to write statistics to, or NULL */
+  const gchar *stats_file;
+  /** File to write the trace to, or NULL if we aren't tracing */
+  const gchar *trace_file;
+  /** Source ID of the SIGUSR2 handler that writes the trace */
+  guint trace_id;
 };
 
 
+static inline gdouble
+msec_since (gint64 start,
+            gint64 end)
+{
+  return (gdouble)(end - start) / 1000.0;
+}
+
+
+/** Record the time at which one of our connections became ready
+    and, once both are, log how long start-up took */
 static void
-update_audio_count (struct wys_data *data,
-                    WysDirection     direction,
-                    gint             delta)
+startup_phase_ready (struct wys_data *data,
+                     gint64          *ready_time,
+                     const gchar     *phase)
 {
-  const guint old_count = data->audio_count[direction];
+  const gboolean first = (*ready_time == 0);
 
-  g_assert (delta >= 0 || data->audio_count[direction] > 0);
+  *ready_time = g_get_monotonic_time ();
 
-  data->audio_count[direction] += delta;
+  g_debug ("%s ready after %.1fms", phase,
+           msec_since (data->start_time, *ready_time));
 
-  if (data->audio_count[direction] > 0 && old_count == 0)
+  if (first && data->audio_ready_time != 0 && data->mm_ready_time != 0)
     {
-      g_debug ("Audio %s now present",
-               wys_direction_get_description (direction));
-      wys_audio_ensure_loopback (data->audio, direction);
+      g_message ("Ready after %.1fms (PulseAudio %.1fms,"
+                 " ModemManager %.1fms)",
+                 msec_since (data->start_time,
+                             MAX (data->audio_ready_time,
+                                  data->mm_ready_time)),
+                 msec_since (data->start_time, data->audio_ready_time),
+                 msec_since (data->start_time, data->mm_ready_time));
     }
-  else if (data->audio_count[direction] == 0 && old_count > 0)
+}
+
+
+/** Bring the loopbacks back in line with the calls that the modems
+    know about, after (re)connecting to PulseAudio */
+static void
+resync_audio (struct route *route)
+{
+  WysDirection direction;
+  GHashTableIter iter;
+  WysModem *modem;
+
+  for (direction = WYS_DIRECTION_FROM_NETWORK;
+       direction <= WYS_DIRECTION_TO_NETWORK;
+       ++direction)
     {
-      g_debug ("Audio %s now absent",
-               wys_direction_get_description (direction));
-      wys_audio_ensure_no_loopback (data->audio, direction);
+      guint count = 0;
+
+      g_hash_table_iter_init (&iter, route->modems);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&modem))
+        {
+          if (wys_modem_get_audio (modem, direction))
+            {
+              ++count;
+            }
+        }
+
+      if (count != route->audio_count[direction])
+        {
+          g_warning ("Audio %s count was %u but %u modems have audio",
+                     wys_direction_get_description (direction),
+                     route->audio_count[direction], count);
+          route->audio_count[direction] = count;
+        }
+
+      if (count > 0)
+        {
+          wys_audio_ensure_loopback (route->audio, direction);
+        }
+      else if (route->grace_ids[direction] == 0)
+        {
+          wys_audio_ensure_no_loopback (route->audio, direction);
+        }
     }
 }
 
 
 static void
-audio_present_cb (struct wys_data *data,
-                  WysDirection     direction,
-                  WysModem        *modem)
+audio_ready_cb (struct route *route)
+{
+  startup_phase_ready (route->data, &route->data->audio_ready_time,
+                       "PulseAudio");
+  resync_audio (route);
+}
+
+
+static inline const gchar *
+route_get_description (struct route *route)
 {
-  update_audio_count (data, direction, +1);
+  return route->alsa_card ? route->alsa_card : "(detected)";
+}
+
+
+struct grace_data
+{
+  struct route *route;
+  WysDirection direction;
+};
+
+
+static gboolean
+grace_timeout_cb (struct grace_data *grace)
+{
+  struct route *route = grace->route;
+  const WysDirection direction = grace->direction;
+
+  route->grace_ids[direction] = 0;
+
+  g_debug ("Audio %s on `%s' absent for %ums, removing loopback",
+           wys_direction_get_description (direction),
+           route_get_description (route),
+           route->data->hold_grace);
+  wys_audio_ensure_no_loopback (route->audio, direction);
+
+  return G_SOURCE_REMOVE;
 }
 
 
 static void
-audio_absent_cb (struct wys_data *data,
-                 WysDirection     direction,
-                 WysModem        *modem)
+audio_absent (struct route *route,
+              WysDirection  direction)
 {
-  update_audio_count (data, direction, -1);
+  struct grace_data *grace;
+
+  if (route->data->hold_grace == 0)
+    {
+      wys_audio_ensure_no_loopback (route->audio, direction);
+      return;
+    }
+
+  grace = g_new (struct grace_data, 1);
+  grace->route = route;
+  grace->direction = direction;
+
+  route->grace_ids[direction] =
+    g_timeout_add_full (G_PRIORITY_DEFAULT,
+                        route->data->hold_grace,
+                        (GSourceFunc)grace_timeout_cb,
+                        grace, g_free);
+}
+
+
+static void
+audio_present (struct route *route,
+               WysDirection  direction)
+{
+  if (route->grace_ids[direction] != 0)
+    {
+      /* Audio came back within the grace period, such as when
+         one call is put on hold and another made active */
+      g_debug ("Audio %s on `%s' back within %ums, keeping loopback",
+               wys_direction_get_description (direction),
+               route_get_description (route),
+               route->data->hold_grace);
+      g_source_remove (route->grace_ids[direction]);
+      route->grace_ids[direction] = 0;
+      return;
+    }
+
+  wys_audio_ensure_loopback (route->audio, direction);
+}
+
+
+static void
+update_audio_count (struct route *route,
+                    WysDirection  direction,
+                    gint          delta)
+{
+  const guint old_count = route->audio_count[direction];
+
+  g_assert (delta >= 0 || route->audio_count[direction] > 0);
+
+  route->audio_count[direction] += delta;
+
+  if (route->audio_count[direction] > 0 && old_count == 0)
+    {
+      g_debug ("Audio %s on `%s' now present",
+               wys_direction_get_description (direction),
+               route_get_description (route));
+      audio_present (route, direction);
+    }
+  else if (route->audio_count[direction] == 0 && old_count > 0)
+    {
+      g_debug ("Audio %s on `%s' now absent",
+               wys_direction_get_description (direction),
+               route_get_description (route));
+      audio_absent (route, direction);
+    }
+}
+
+
+static void
+audio_present_cb (struct route *route,
+                  WysDirection  direction,
+                  WysModem     *modem)
+{
+  update_audio_count (route, direction, +1);
+}
+
+
+static void
+audio_absent_cb (struct route *route,
+                 WysDirection  direction,
+                 WysModem     *modem)
+{
+  update_audio_count (route, direction, -1);
+}
+
+
+static struct route *
+route_new (struct wys_data *data,
+           const gchar     *alsa_card)
+{
+  struct route *route = g_new0 (struct route, 1);
+
+  g_debug ("Adding route for ALSA card `%s'",
+           alsa_card ? alsa_card : "(detected)");
+
+  route->data = data;
+  route->alsa_card = g_strdup (alsa_card);
+  route->modems = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_object_unref);
+  route->audio = wys_audio_new (alsa_card, data->standby,
+                                data->profile);
+  g_signal_connect_swapped (route->audio, "ready",
+                            G_CALLBACK (audio_ready_cb), route);
+
+  return route;
+}
+
+
+/** Routes dropped on exit leave their modules loaded for the next
+    run to take over; a retired route releases them first */
+static void
+route_free (struct route *route)
+{
+  g_clear_handle_id (&route->grace_ids[WYS_DIRECTION_FROM_NETWORK],
+                     g_source_remove);
+  g_clear_handle_id (&route->grace_ids[WYS_DIRECTION_TO_NETWORK],
+                     g_source_remove);
+  g_hash_table_unref (route->modems);
+  g_object_unref (route->audio);
+  g_free (route->alsa_card);
+  g_free (route);
+}
+
+
+/** Keep a default route that detects its card away from the cards
+    that other routes have */
+static void
+exclude_route_cards (struct wys_data *data)
+{
+  struct route *route;
+  guint i;
+
+  if (!data->default_route || data->default_route->alsa_card)
+    {
+      return;
+    }
+
+  for (i = 0; i < data->routes->len; ++i)
+    {
+      route = g_ptr_array_index (data->routes, i);
+      if (route != data->default_route)
+        {
+          wys_audio_exclude_card (data->default_route->audio,
+                                  route->alsa_card);
+        }
+    }
+}
+
+
+static struct route *
+ensure_default_route (struct wys_data *data)
+{
+  if (!data->default_route)
+    {
+      data->default_route = route_new (data, data->modem);
+      g_ptr_array_add (data->routes, data->default_route);
+      exclude_route_cards (data);
+    }
+
+  return data->default_route;
+}
+
+
+/** Let a default route that detects its card go once it has no
+    modems and other routes have taken over.  It would otherwise hold
+    on to a PulseAudio connection, and perhaps an echo canceller, for
+    nothing.  It's added again if a modem without a card turns up. */
+static void
+retire_default_route (struct wys_data *data)
+{
+  struct route *route = data->default_route;
+
+  if (!route
+      || route->alsa_card
+      || data->routes->len == 1
+      || g_hash_table_size (route->modems) > 0)
+    {
+      return;
+    }
+
+  g_debug ("Retiring the default route");
+  wys_audio_release (route->audio);
+  data->default_route = NULL;
+  g_ptr_array_remove (data->routes, route);
+}
+
+
+/** Find the route for @alsa_card, adding one if there is none.
+    Modems without a card of their own, with @alsa_card NULL, share
+    the default route. */
+static struct route *
+ensure_route (struct wys_data *data,
+              const gchar     *alsa_card)
+{
+  struct route *route;
+  guint i;
+
+  if (!alsa_card)
+    {
+      return ensure_default_route (data);
+    }
+
+  for (i = 0; i < data->routes->len; ++i)
+    {
+      route = g_ptr_array_index (data->routes, i);
+      if (g_strcmp0 (route->alsa_card, alsa_card) == 0)
+        {
+          return route;
+        }
+    }
+
+  route = route_new (data, alsa_card);
+  g_ptr_array_add (data->routes, route);
+  exclude_route_cards (data);
+  return route;
+}
+
+
+static const gchar *
+modem_object_get_device (GDBusObject *object)
+{
+  MMModem *modem;
+
+  modem = mm_object_peek_modem (MM_OBJECT (object));
+  if (!modem)
+    {
+      return NULL;
+    }
+
+  return mm_modem_get_device (modem);
+}
+
+
+/** Find the ALSA card under a modem's device in sysfs.  Matches are
+    kept until the modem goes away; a modem without a card is looked
+    up again when it comes back, since its card may appear later. */
+static const gchar *
+match_alsa_card (struct wys_data *data,
+                 const gchar     *device)
+{
+  gchar *card;
+
+  card = g_hash_table_lookup (data->matched_cards, device);
+  if (card)
+    {
+      return card;
+    }
+
+  card = wys_sysfs_find_alsa_card (device);
+  if (!card)
+    {
+      return NULL;
+    }
+
+  g_hash_table_insert (data->matched_cards, g_strdup (device), card);
+  return card;
+}
+
+
+/** Look up the ALSA card for a modem by the modem's device, from
+    the configured table or else from sysfs, returning NULL if there
+    is none.  A card given with --modem is meant for every modem that
+    isn't in the table, so sysfs isn't consulted then. */
+static const gchar *
+modem_alsa_card (struct wys_data *data,
+                 GDBusObject     *object)
+{
+  const gchar *device, *card = NULL;
+
+  device = modem_object_get_device (object);
+  if (!device)
+    {
+      return NULL;
+    }
+
+  if (data->modem_cards)
+    {
+      card = g_hash_table_lookup (data->modem_cards, device);
+    }
+
+  if (!card && !data->modem)
+    {
+      card = match_alsa_card (data, device);
+    }
+
+  return card;
 }
 
 
@@ -116,6 +553,7 @@ add_modem (struct wys_data *data,
   const gchar *path;
   MMModemVoice *voice;
   WysModem *modem;
+  struct route *route;
 
   path = g_dbus_object_get_object_path (object);
   if (g_hash_table_contains (data->modems, path))
@@ -131,18 +569,30 @@ add_modem (struct wys_data *data,
   voice = mm_object_get_modem_voice (MM_OBJECT (object));
   g_assert (voice != NULL);
 
-  modem = wys_modem_new (voice);
+  route = ensure_route (data, modem_alsa_card (data, object));
+  g_debug ("Routing modem `%s' audio to ALSA card `%s'",
+           path, route_get_description (route));
 
-  g_hash_table_insert (data->modems,
+  modem = wys_modem_new (voice, data->lean_calls);
+
+  g_hash_table_insert (route->modems,
                        strdup (path),
                        modem);
+  g_hash_table_insert (data->modems,
+                       strdup (path),
+                       route);
 
   g_signal_connect_swapped (modem, "audio-present",
                             G_CALLBACK (audio_present_cb),
-                            data);
+                            route);
   g_signal_connect_swapped (modem, "audio-absent",
                             G_CALLBACK (audio_absent_cb),
-                            data);
+                            route);
+
+  if (!data->adding_mm_objects)
+    {
+      retire_default_route (data);
+    }
 }
 
 
@@ -166,12 +616,39 @@ interface_added_cb (struct wys_data *data,
 }
 
 
+/** Forget what a modem's device was matched to.  The modem may come
+    back with another card, such as after re-enumerating. */
+static void
+forget_alsa_card (struct wys_data *data,
+                  const gchar     *device)
+{
+  if (device)
+    {
+      g_hash_table_remove (data->matched_cards, device);
+    }
+}
+
+
 static void
 remove_modem_object (struct wys_data *data,
                      const gchar     *path,
                      GDBusObject     *object)
 {
+  struct route *route;
+
+  /* On unplug, the object goes with its interfaces still on it */
+  forget_alsa_card (data, modem_object_get_device (object));
+
+  route = g_hash_table_lookup (data->modems, path);
+  if (!route)
+    {
+      return;
+    }
+
+  g_hash_table_remove (route->modems, path);
   g_hash_table_remove (data->modems, path);
+
+  retire_default_route (data);
 }
 
 
@@ -193,6 +670,10 @@ interface_removed_cb (struct wys_data *data,
     {
       remove_modem_object (data, path, object);
     }
+  else if (g_strcmp0 (info->name, MM_DBUS_INTERFACE_MODEM) == 0)
+    {
+      forget_alsa_card (data, mm_modem_get_device (MM_MODEM (interface)));
+    }
 }
 
 
@@ -233,6 +714,7 @@ object_added_cb (struct wys_data *data,
 {
   g_debug ("ModemManager object `%s' added",
            g_dbus_object_get_object_path (object));
+  wys_trace_instant ("mm", "object_added");
 
   add_mm_object (data, object);
 }
@@ -246,6 +728,7 @@ object_removed_cb (struct wys_data *data,
 
   path = g_dbus_object_get_object_path (object);
   g_debug ("ModemManager object `%s' removed", path);
+  wys_trace_instant ("mm", "object_removed");
 
   remove_modem_object (data, path, object);
 }
@@ -258,6 +741,8 @@ mm_manager_new_cb (GDBusConnection *connection,
 {
   GError *error = NULL;
 
+  wys_trace_async_end ("mm", "manager_new", WYS_TRACE_ID (data));
+
   data->mm = mm_manager_new_finish (res, &error);
   if (!data->mm)
     {
@@ -279,7 +764,12 @@ mm_manager_new_cb (GDBusConnection *connection,
                             "object-removed",
                             G_CALLBACK (object_removed_cb), data);
 
+  data->adding_mm_objects = TRUE;
   add_mm_objects (data);
+  data->adding_mm_objects = FALSE;
+  retire_default_route (data);
+
+  startup_phase_ready (data, &data->mm_ready_time, "ModemManager");
 }
 
 static void
@@ -288,8 +778,10 @@ mm_appeared_cb (GDBusConnection *connection,
                 const gchar *name_owner,
                 struct wys_data *data)
 {
-  g_debug ("ModemManager appeared on D-Bus");
+  g_debug ("ModemManager appeared on D-Bus after %.1fms",
+           msec_since (data->start_time, g_get_monotonic_time ()));
 
+  wys_trace_async_begin ("mm", "manager_new", WYS_TRACE_ID (data));
   mm_manager_new (connection,
                   G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
                   NULL,
@@ -301,7 +793,15 @@ mm_appeared_cb (GDBusConnection *connection,
 static void
 clear_dbus (struct wys_data *data)
 {
+  guint i;
+
+  for (i = 0; i < data->routes->len; ++i)
+    {
+      struct route *route = g_ptr_array_index (data->routes, i);
+      g_hash_table_remove_all (route->modems);
+    }
   g_hash_table_remove_all (data->modems);
+  g_hash_table_remove_all (data->matched_cards);
 
   g_clear_object (&data->mm);
 }
@@ -317,14 +817,140 @@ mm_vanished_cb (GDBusConnection *connection,
 }
 
 
+/** Write each route's statistics.  The default route's go to the
+    statistics file itself and each other route's to the file name
+    with its ALSA card name appended. */
+static void
+write_stats (struct wys_data *data)
+{
+  GError *error = NULL;
+  guint i;
+
+  if (!data->stats_file)
+    {
+      return;
+    }
+
+  for (i = 0; i < data->routes->len; ++i)
+    {
+      struct route *route = g_ptr_array_index (data->routes, i);
+      g_autofree gchar *filename = NULL;
+
+      if (route == data->default_route)
+        {
+          filename = g_strdup (data->stats_file);
+        }
+      else
+        {
+          filename = g_strdup_printf ("%s.%s", data->stats_file,
+                                      route->alsa_card);
+          g_strdelimit (filename + strlen (data->stats_file),
+                        G_DIR_SEPARATOR_S, '_');
+        }
+
+      if (!wys_audio_write_stats (route->audio, filename, &error))
+        {
+          g_warning ("Error writing statistics: %s", error->message);
+          g_clear_error (&error);
+        }
+    }
+}
+
+
+static gboolean
+log_stats_cb (struct wys_data *data)
+{
+  GHashTableIter iter;
+  WysModem *modem;
+  guint i;
+
+  for (i = 0; i < data->routes->len; ++i)
+    {
+      struct route *route = g_ptr_array_index (data->routes, i);
+
+      if (data->routes->len > 1)
+        {
+          g_message ("Route for ALSA card `%s':",
+                     route_get_description (route));
+        }
+      wys_audio_log_stats (route->audio);
+
+      g_hash_table_iter_init (&iter, route->modems);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&modem))
+        {
+          wys_modem_log_calls (modem);
+        }
+    }
+
+  wys_flight_log ();
+
+  write_stats (data);
+  return G_SOURCE_CONTINUE;
+}
+
+
+static gboolean
+flush_trace_cb (struct wys_data *data)
+{
+  GError *error = NULL;
+
+  if (wys_trace_flush (data->trace_file, &error))
+    {
+      g_message ("Wrote trace to `%s'", data->trace_file);
+    }
+  else
+    {
+      g_warning ("Error writing trace: %s", error->message);
+      g_error_free (error);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+
 static void
 set_up (struct wys_data *data,
-        const gchar *modem)
+        const gchar *modem,
+        gboolean     standby,
+        const struct wys_audio_profile *profile,
+        GHashTable  *modem_cards,
+        guint        hold_grace,
+        gboolean     lean_calls,
+        const gchar *trace_file,
+        const gchar *stats_file)
 {
-  data->audio = wys_audio_new (modem);
+  /* Both connections are made asynchronously and in parallel;
+     we act on call audio as soon as each becomes ready */
+  data->start_time = g_get_monotonic_time ();
+
+  data->modem = modem;
+  data->standby = standby;
+  data->profile = profile;
+  data->modem_cards = modem_cards;
+  data->hold_grace = hold_grace;
+  data->lean_calls = lean_calls;
+  data->stats_file = stats_file;
+
+  /* Connect to PulseAudio for the default route straight away; the
+     others are added as their modems appear */
+  data->routes = g_ptr_array_new_with_free_func ((GDestroyNotify)route_free);
+  ensure_default_route (data);
+
+  data->stats_id = g_unix_signal_add (SIGUSR1,
+                                      (GSourceFunc)log_stats_cb,
+                                      data);
+  if (trace_file)
+    {
+      data->trace_file = trace_file;
+      data->trace_id = g_unix_signal_add (SIGUSR2,
+                                          (GSourceFunc)flush_trace_cb,
+                                          data);
+    }
 
   data->modems = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                        g_free, g_object_unref);
+                                        g_free, NULL);
+  data->matched_cards = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
 
   data->watch_id =
     g_bus_watch_name (G_BUS_TYPE_SYSTEM,
@@ -341,20 +967,32 @@ set_up (struct wys_data *data,
 static void
 tear_down (struct wys_data *data)
 {
+  g_clear_handle_id (&data->stats_id, g_source_remove);
+  g_clear_handle_id (&data->trace_id, g_source_remove);
+  write_stats (data);
   clear_dbus (data);
   g_bus_unwatch_name (data->watch_id);
   g_hash_table_unref (data->modems);
-  g_object_unref (G_OBJECT (data->audio));
+  g_hash_table_unref (data->matched_cards);
+  g_ptr_array_unref (data->routes);
 }
 
 
 static void
-run (const gchar *modem)
+run (const gchar *modem,
+     gboolean     standby,
+     const struct wys_audio_profile *profile,
+     GHashTable  *modem_cards,
+     guint        hold_grace,
+     gboolean     lean_calls,
+     const gchar *trace_file,
+     const gchar *stats_file)
 {
   struct wys_data data;
 
   memset (&data, 0, sizeof (struct wys_data));
-  set_up (&data, modem);
+  set_up (&data, modem, standby, profile, modem_cards, hold_grace,
+          lean_calls, trace_file, stats_file);
 
   main_loop = g_main_loop_new (NULL, FALSE);
 
@@ -559,36 +1197,208 @@ machine_conf (const gchar *machine,
 }
 
 
+/** Fill in a setting that wasn't given on the command line from the
+    environment or, failing that, the machine configuration.
+    Returns whether the setting has a value. */
+static gboolean
+ensure_setting (const gchar  *machine,
+                const gchar  *var,
+                const gchar  *key,
+                      gchar **value)
+{
+  const gchar *env;
+
+  if (*value)
+    {
+      return TRUE;
+    }
+
+  env = g_getenv (var);
+  if (env)
+    {
+      *value = g_strdup (env);
+      return TRUE;
+    }
+
+  if (machine)
+    {
+      *value = machine_conf (machine, key);
+      if (*value)
+        {
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+
 static void
 ensure_alsa_card (const gchar  *machine,
                   const gchar  *var,
                   const gchar  *key,
                         gchar **name)
 {
-  const gchar *env;
+  if (!ensure_setting (machine, var, key, name))
+    {
+      g_debug ("No predefined modem found, detecting dynamically.");
+    }
+}
+
+
+static guint
+ensure_uint (const gchar *machine,
+             const gchar *var,
+             const gchar *key,
+             const gchar *option,
+             guint        fallback)
+{
+  g_autofree gchar *value = g_strdup (option);
+  guint64 number;
+  GError *error = NULL;
+  gboolean ok;
 
-  if (*name)
+  if (!ensure_setting (machine, var, key, &value))
     {
-      return;
+      return fallback;
     }
 
-  env = g_getenv (var);
-  if (env)
+  ok = g_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT,
+                                   &number, &error);
+  if (!ok)
+    {
+      g_warning ("Invalid %s `%s': %s, using %u",
+                 key, value, error->message, fallback);
+      g_error_free (error);
+      return fallback;
+    }
+
+  return (guint)number;
+}
+
+
+/** Like ensure_setting() for a flag; a value which is empty or "0"
+    leaves the flag unset.  @key may be NULL for a flag that can't be
+    set in the machine configuration. */
+static void
+ensure_flag (const gchar *machine,
+             const gchar *var,
+             const gchar *key,
+             gboolean    *flag)
+{
+  g_autofree gchar *value = NULL;
+
+  if (*flag)
     {
-      *name = g_strdup (env);
       return;
     }
 
-  if (machine)
+  if (ensure_setting (key ? machine : NULL, var, key, &value)
+      && value[0] != '\0' && strcmp (value, "0") != 0)
+    {
+      *flag = TRUE;
+    }
+}
+
+
+/** Read the table of ALSA cards for particular modems, given as
+    "DEVICE=CARD" entries separated by ";" where DEVICE is the
+    modem's device as ModemManager reports it.  Returns NULL if
+    there is no table. */
+static GHashTable *
+ensure_modem_cards (const gchar *machine)
+{
+  g_autofree gchar *value = NULL;
+  gchar **entries, **entry;
+  GHashTable *cards;
+
+  if (!ensure_setting (machine, "WYS_MODEM_CARDS", "modem-cards",
+                       &value))
     {
-      *name = machine_conf (machine, key);
-      if (*name)
+      return NULL;
+    }
+
+  cards = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                 g_free, g_free);
+
+  entries = g_strsplit (value, ";", -1);
+  for (entry = entries; *entry; ++entry)
+    {
+      gchar *sep;
+
+      g_strstrip (*entry);
+      if ((*entry)[0] == '\0')
+        {
+          continue;
+        }
+
+      sep = strchr (*entry, '=');
+      if (!sep || sep == *entry || sep[1] == '\0')
         {
-          return;
+          g_warning ("Invalid modem-cards entry `%s'", *entry);
+          continue;
         }
+
+      *sep = '\0';
+      g_debug ("Modem device `%s' uses ALSA card `%s'",
+               *entry, sep + 1);
+      g_hash_table_insert (cards, g_strdup (*entry),
+                           g_strdup (sep + 1));
     }
+  g_strfreev (entries);
+
+  return cards;
+}
+
 
-  g_debug ("No predefined modem found, detecting dynamically.");
+/** Fill in the loopback profile from the command line, the
+    environment and the machine configuration */
+static void
+ensure_profile (const gchar              *machine,
+                struct wys_audio_profile *profile,
+                const gchar              *latency_min_option,
+                const gchar              *latency_max_option)
+{
+#define ensure_number(field, name, VAR, fallback)                       \
+  profile->field = ensure_uint (machine, "WYS_" VAR, name, NULL,        \
+                                fallback)
+
+  ensure_setting (machine, "WYS_SAMPLE_FORMAT", "sample-format",
+                  &profile->sample_format);
+  ensure_number (sample_rate,      "sample-rate",      "SAMPLE_RATE",      0);
+  ensure_number (channels,         "channels",         "CHANNELS",         0);
+  if (profile->channels > PA_CHANNELS_MAX)
+    {
+      /* A sample spec holds the channel count in a uint8_t */
+      g_warning ("Invalid channels `%u': more than %u, using the modem's",
+                 profile->channels, PA_CHANNELS_MAX);
+      profile->channels = 0;
+    }
+  ensure_setting (machine, "WYS_RESAMPLE_METHOD", "resample-method",
+                  &profile->resample_method);
+  ensure_number (latency,          "latency",          "LATENCY",          0);
+  ensure_number (adjust_threshold, "adjust-threshold", "ADJUST_THRESHOLD", 0);
+  ensure_number (adjust_time,      "adjust-time",      "ADJUST_TIME",      0);
+
+#undef ensure_number
+
+  ensure_flag (machine, "WYS_ADAPTIVE_LATENCY", "adaptive-latency",
+               &profile->adaptive_latency);
+  profile->latency_min = ensure_uint (machine, "WYS_LATENCY_MIN",
+                                      "latency-min",
+                                      latency_min_option,
+                                      DEFAULT_LATENCY_MIN_MSEC);
+  profile->latency_max = ensure_uint (machine, "WYS_LATENCY_MAX",
+                                      "latency-max",
+                                      latency_max_option,
+                                      DEFAULT_LATENCY_MAX_MSEC);
+
+  ensure_flag (machine, "WYS_ECHO_CANCEL", "echo-cancel",
+               &profile->echo_cancel);
+  ensure_setting (machine, "WYS_AEC_METHOD", "aec-method",
+                  &profile->aec_method);
+  ensure_setting (machine, "WYS_AEC_ARGS", "aec-args",
+                  &profile->aec_args);
 }
 
 
@@ -600,10 +1410,31 @@ main (int argc, char **argv)
   gboolean ok;
   g_autofree gchar *modem = NULL;
   g_autofree gchar *machine = NULL;
+  gboolean standby = FALSE;
+  struct wys_audio_profile profile = { NULL, };
+  g_autofree gchar *latency_min_option = NULL;
+  g_autofree gchar *latency_max_option = NULL;
+  g_autofree gchar *hold_grace_option = NULL;
+  guint hold_grace;
+  gboolean lean_calls = FALSE;
+  g_autofree gchar *trace_file = NULL;
+  g_autofree gchar *stats_file = NULL;
+  GHashTable *modem_cards;
 
   GOptionEntry options[] =
     {
       { "modem", 'm', 0, G_OPTION_ARG_STRING, &modem, "Name of the modem's ALSA card", "NAME" },
+      { "standby", 's', 0, G_OPTION_ARG_NONE, &standby, "Keep muted loopbacks loaded between calls", NULL },
+      { "resample-method", 'r', 0, G_OPTION_ARG_STRING, &profile.resample_method, "PulseAudio resampler for the loopbacks", "METHOD" },
+      { "adaptive-latency", 'a', 0, G_OPTION_ARG_NONE, &profile.adaptive_latency, "Adapt the loopback latency to what the devices can sustain", NULL },
+      { "latency-min", 0, 0, G_OPTION_ARG_STRING, &latency_min_option, "Lowest adaptive loopback latency", "MSEC" },
+      { "latency-max", 0, 0, G_OPTION_ARG_STRING, &latency_max_option, "Highest adaptive loopback latency", "MSEC" },
+      { "echo-cancel", 'e', 0, G_OPTION_ARG_NONE, &profile.echo_cancel, "Keep an echo canceller loaded for the loopbacks", NULL },
+      { "aec-method", 0, 0, G_OPTION_ARG_STRING, &profile.aec_method, "Echo canceller implementation", "METHOD" },
+      { "hold-grace", 'g', 0, G_OPTION_ARG_STRING, &hold_grace_option, "Time to keep loopbacks after call audio goes away", "MSEC" },
+      { "lean-calls", 'l', 0, G_OPTION_ARG_NONE, &lean_calls, "Track calls with D-Bus signal subscriptions instead of call proxies", NULL },
+      { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_file, "Record a trace, written to FILE on SIGUSR2", "FILE" },
+      { "stats", 0, 0, G_OPTION_ARG_FILENAME, &stats_file, "Write setup statistics to FILE on SIGUSR1 and on exit", "FILE" },
       { NULL }
     };
 
@@ -636,10 +1467,39 @@ main (int argc, char **argv)
     }
 
   ensure_alsa_card (machine, "WYS_MODEM", "modem", &modem);
+  modem_cards = ensure_modem_cards (machine);
+  ensure_flag (machine, "WYS_STANDBY", NULL, &standby);
+  ensure_profile (machine, &profile,
+                  latency_min_option, latency_max_option);
+  hold_grace = ensure_uint (machine, "WYS_HOLD_GRACE", "hold-grace",
+                            hold_grace_option,
+                            DEFAULT_HOLD_GRACE_MSEC);
+  ensure_flag (machine, "WYS_LEAN_CALLS", "lean-calls", &lean_calls);
+
+  ensure_setting (NULL, "WYS_TRACE", NULL, &trace_file);
+  ensure_setting (NULL, "WYS_STATS", NULL, &stats_file);
+  if (trace_file)
+    {
+      wys_trace_start (ensure_uint (NULL, "WYS_TRACE_EVENTS",
+                                    "trace-events", NULL,
+                                    DEFAULT_TRACE_EVENTS));
+    }
 
   setup_signals ();
 
-  run (modem);
+  run (modem, standby, &profile, modem_cards, hold_grace, lean_calls,
+       trace_file, stats_file);
+
+  wys_trace_stop ();
+
+  g_free (profile.sample_format);
+  g_free (profile.resample_method);
+  g_free (profile.aec_method);
+  g_free (profile.aec_args);
+  if (modem_cards)
+    {
+      g_hash_table_unref (modem_cards);
+    }
 
   return 0;
 }
@@ -23,6 +23,10 @@
  */
 
 #include "wys-audio.h"
+#include "wys-flight.h"
+#include "wys-histogram.h"
+#include "wys-trace.h"
+#include "wys-probes.h"
 #include "util.h"
 
 #include <glib/gi18n.h>
@@ -31,14 +35,238 @@
 #include <pulse/glib-mainloop.h>
 
 
+/** Bounds on the delay before reconnecting to PulseAudio; it doubles
+    with each failed attempt */
+#define RECONNECT_MIN_MSEC   50
+#define RECONNECT_MAX_MSEC 5000
+
+/** How often to measure a loopback's latency during a call, how
+    many measurements in a row over its target count as glitching,
+    how far over it may go without counting, and how many
+    measurements a call needs before we try a tighter target */
+#define LATENCY_SAMPLE_MSEC    1000
+#define LATENCY_OVER_SAMPLES      3
+#define LATENCY_SLACK_MSEC        5
+#define LATENCY_STABLE_SAMPLES   10
+
+/** Names of our echo canceller's sink and source.  There is one for
+    all routes, since they all play to the same speaker and record
+    from the same microphone. */
+#define ECHO_CANCEL_SINK   "wys_echo_cancel_sink"
+#define ECHO_CANCEL_SOURCE "wys_echo_cancel_source"
+
+/** Bounds on the delay before trying to load our echo canceller
+    again after it failed to load; it doubles with each failure */
+#define ECHO_CANCEL_RETRY_MIN_MSEC  1000
+#define ECHO_CANCEL_RETRY_MAX_MSEC 60000
+
+/** The adaptive loopback latency to start from, in milliseconds */
+#define LATENCY_INITIAL_MSEC     25
+
+/** PulseAudio operations are traced from when they are issued until
+    their callback runs, keyed by the data passed to the callback */
+#define TRACE_OP_BEGIN(name, data)                              \
+  wys_trace_async_begin ("pulse", name, WYS_TRACE_ID (data))
+#define TRACE_OP_END(name, data)                                \
+  wys_trace_async_end ("pulse", name, WYS_TRACE_ID (data))
+
+/** Single object queries pass the WysAudio to their callback, so
+    they are keyed by the object instead */
+#define CACHE_TRACE_ID(kind, index)             \
+  (((guint64)(kind) << 32) | (index))
+
+
+/** The kinds of PulseAudio object we keep in the object cache */
+enum cache_kind
+{
+  CACHE_SINK = 0,
+  CACHE_SOURCE,
+  CACHE_MODULE,
+  CACHE_SINK_INPUT,
+  CACHE_SOURCE_OUTPUT,
+  CACHE_CARD,
+  CACHE_LAST
+};
+
+
+/** The state of our loopback module in one direction */
+enum loopback_state
+{
+  LOOPBACK_IDLE = 0,
+  LOOPBACK_LOADING,
+  LOOPBACK_ACTIVE,
+  LOOPBACK_UNLOADING
+};
+
+
+struct loopback
+{
+  enum loopback_state state;
+  /** The index of the module while active or unloading,
+      otherwise PA_INVALID_INDEX */
+  uint32_t module;
+  /** The ALSA card the module is for, from when it starts loading
+      until it goes idle */
+  gchar *alsa_card;
+  /** The load or unload operation in progress, if any */
+  pa_operation *op;
+  /** The list operations of the discovery in progress, if any */
+  GPtrArray *discovery;
+  /** The data each of the discovery operations holds a reference
+      on, and how to drop that reference for a cancelled one */
+  gpointer discovery_data;
+  GDestroyNotify discovery_cancel;
+};
+
+
+/** Adaptive control of the latency of our loopback module */
+struct latency_control
+{
+  /** The latency to load the loopback with, in milliseconds */
+  guint target;
+  /** Source ID of the sampling timeout while the loopback carries
+      call audio, or 0 */
+  guint sample_id;
+  /** How many samples have been taken, and how many in a row were
+      over the target */
+  guint samples;
+  guint over;
+  /** Whether the loopback has glitched during the current call */
+  gboolean glitched;
+};
+
+
+/** The asynchronous stages of setting up and tearing down a loopback,
+    followed by the totals */
+enum span_stage
+{
+  SPAN_WAIT = 0,
+  SPAN_DISCOVER,
+  SPAN_DEVICE,
+  SPAN_LOAD,
+  SPAN_STREAM,
+  SPAN_UNLOAD,
+  SPAN_SETUP,
+  SPAN_TEARDOWN,
+  SPAN_LAST
+};
+
+
+/** The timing of the setup or teardown of a loopback in progress */
+struct span
+{
+  /** Monotonic times at which the setup or teardown and the current
+      stage began; start is 0 when there's none in progress */
+  gint64 start;
+  gint64 stage_start;
+  enum span_stage stage;
+  gboolean teardown;
+};
+
+
+/** Measurements of one of our loopbacks over the current call */
+struct call_telemetry
+{
+  /** Latency of the streams' buffers, of the sink and source, and in
+      total, in milliseconds */
+  WysHistogram *buffer;
+  WysHistogram *device;
+  WysHistogram *total;
+  /** How far module-loopback has adjusted the rate, in parts per
+      million either way */
+  WysHistogram *drift;
+  /** How many times the loopback has gone well over its target.
+      PulseAudio doesn't tell clients about underruns, but this is
+      how module-loopback rides them out. */
+  guint underruns;
+};
+
+
 struct _WysAudio
 {
   GObject parent_instance;
 
+  /** The ALSA card name of the modem, either given to us or found
+      from the cards' "device.class" property */
   gchar             *modem;
+  /** Whether the modem's ALSA card name was given to us */
+  gboolean           modem_configured;
+  /** ALSA card names that other instances have been given, which
+      detection passes over */
+  GHashTable        *excluded_cards;
+  /** The index of the modem's card, or PA_INVALID_INDEX while there
+      is none */
+  uint32_t           modem_card;
+  /** Whether wys_audio_release() has been called, after which we
+      want no loopbacks or echo canceller */
+  gboolean           released;
   pa_glib_mainloop  *loop;
   pa_context        *ctx;
   gboolean           ready;
+  /** Source ID of a pending reconnection and the delay before the
+      next one, in milliseconds */
+  guint              reconnect_id;
+  guint              reconnect_delay;
+
+  /** Maps of PulseAudio object indices to struct cache_object,
+      one for each enum cache_kind */
+  GHashTable        *cache[CACHE_LAST];
+  /** How many of the initial object list operations are still
+      outstanding */
+  guint              cache_pending;
+  /** Whether the cache reflects the server's state and can be
+      used in place of querying the server */
+  gboolean           cache_synced;
+
+  /** Our loopback module, in each direction */
+  struct loopback    loopbacks[2];
+  /** Whether call audio is wanted, in each direction */
+  gboolean           audio[2];
+  /** Whether to keep muted loopbacks loaded between calls */
+  gboolean           standby;
+  /** Overrides of the modem's sample spec for the loopbacks, or
+      PA_SAMPLE_INVALID and 0 */
+  pa_sample_format_t sample_format;
+  guint              sample_rate;
+  guint              channels;
+  /** The resampler for the loopbacks, or NULL for the server's
+      default */
+  gchar             *resample_method;
+  /** The loopback latency, fast adjustment threshold (both in
+      milliseconds) and adjustment interval (in seconds), or 0 for
+      module-loopback's defaults */
+  guint              target_latency;
+  guint              adjust_threshold;
+  guint              adjust_time;
+  /** Whether to adapt the loopback latency to what the devices can
+      sustain, and the bounds in milliseconds */
+  gboolean           adaptive;
+  guint              latency_min;
+  guint              latency_max;
+  struct latency_control latency[2];
+  struct call_telemetry telemetry[2];
+  /** Setup or teardown timing in each direction, and the durations
+      of each stage and in total, in milliseconds */
+  struct span        spans[2];
+  WysHistogram      *span_stats[SPAN_LAST];
+  /** Whether to keep our own echo canceller for the loopbacks to
+      attach to, and its method and arguments */
+  gboolean           echo_cancel;
+  gchar             *aec_method;
+  gchar             *aec_args;
+  /** The index of our echo canceller module, or PA_INVALID_INDEX,
+      and the load operation in progress, if any */
+  uint32_t           echo_cancel_module;
+  pa_operation      *echo_cancel_op;
+  /** How many echo canceller unloads are in progress, each holding
+      a reference */
+  guint              echo_cancel_unloads;
+  /** Whether our echo canceller failed to load, so that the
+      loopbacks ask filter-apply for one meanwhile, and the source ID
+      and delay of the next attempt */
+  gboolean           echo_cancel_failed;
+  guint              echo_cancel_retry_id;
+  guint              echo_cancel_retry_delay;
 };
 
 G_DEFINE_TYPE (WysAudio, wys_audio, G_TYPE_OBJECT);
@@ -47,10 +275,59 @@ G_DEFINE_TYPE (WysAudio, wys_audio, G_TYPE_OBJECT);
 enum {
   PROP_0,
   PROP_MODEM,
+  PROP_STANDBY,
+  PROP_SAMPLE_FORMAT,
+  PROP_SAMPLE_RATE,
+  PROP_CHANNELS,
+  PROP_RESAMPLE_METHOD,
+  PROP_LATENCY,
+  PROP_ADJUST_THRESHOLD,
+  PROP_ADJUST_TIME,
+  PROP_ADAPTIVE_LATENCY,
+  PROP_LATENCY_MIN,
+  PROP_LATENCY_MAX,
+  PROP_ECHO_CANCEL,
+  PROP_AEC_METHOD,
+  PROP_AEC_ARGS,
   PROP_LAST_PROP,
 };
 static GParamSpec *props[PROP_LAST_PROP];
 
+enum {
+  SIGNAL_READY,
+  SIGNAL_LAST_SIGNAL,
+};
+static guint signals [SIGNAL_LAST_SIGNAL];
+
+
+struct cache_object;
+
+static void schedule_reconnect (WysAudio *self);
+static void update_loopbacks (WysAudio *self);
+static void loopback_update (WysAudio *self, WysDirection direction);
+static void loopback_module_removed (WysAudio *self, uint32_t index);
+static void loopback_reset (WysAudio *self, WysDirection direction);
+static void loopback_discovery_cancel (WysAudio *self, WysDirection direction);
+static void ensure_no_loopback_modules_cb (gpointer data, pa_context *ctx);
+static void standby_apply (WysAudio *self, WysDirection direction);
+static void latency_update (WysAudio *self, WysDirection direction);
+static void telemetry_init (struct call_telemetry *telemetry);
+static void telemetry_clear (struct call_telemetry *telemetry);
+static void span_begin (WysAudio *self, WysDirection direction, gboolean teardown);
+static void span_stage (WysAudio *self, WysDirection direction, enum span_stage stage);
+static void span_end (WysAudio *self, WysDirection direction, gboolean teardown);
+static void span_abandon (WysAudio *self, WysDirection direction);
+static void span_streams_check (WysAudio *self, WysDirection direction);
+static void echo_cancel_update (WysAudio *self);
+static void echo_cancel_module_removed (WysAudio *self, uint32_t index);
+static void echo_cancel_reset (WysAudio *self);
+static void echo_cancel_release (WysAudio *self);
+static inline gboolean echo_cancel_ready (WysAudio *self);
+static inline gboolean echo_cancel_attached (WysAudio *self);
+static void modem_object_added (WysAudio *self, enum cache_kind kind, struct cache_object *object);
+static void modem_card_removed (WysAudio *self, uint32_t index);
+static gboolean props_name_alsa_card (pa_proplist *props, const gchar *alsa_card);
+
 
 static void
 proplist_set (pa_proplist *props,
@@ -66,1207 +343,4325 @@ proplist_set (pa_proplist *props,
 }
 
 
-static void
-get_card_info_cb (pa_context *audio,
-                  const pa_card_info *info,
-                  int is_last, void *userdata)
-{
-  WysAudio *self = WYS_AUDIO (userdata);
-  const char *class, *alsa_card;
+/**************** Object cache ****************/
 
-  if (is_last < 0)
-    {
-      g_warning ("Failed to get card information: %s",
-                 pa_strerror (pa_context_errno (self->ctx)));
-      return;
-    }
+/** A copy of the parts of a PulseAudio sink, source, module, sink
+    input, source output or card that we need for finding devices and
+    loopbacks.  Fields which don't apply to the kind of object are
+    PA_INVALID_INDEX. */
+struct cache_object
+{
+  uint32_t index;
+  gchar *name;
+  pa_proplist *proplist;
+  /** The module which owns a stream, sink or source */
+  uint32_t owner_module;
+  /** The sink of a sink input or source of a source output */
+  uint32_t device;
+  /** The card of a sink or source */
+  uint32_t card;
+  pa_sample_spec sample_spec;
+  /** Whether a stream is muted */
+  gboolean mute;
+};
 
-  if (is_last)
-    return;
 
-  class = pa_proplist_gets (info->proplist, "device.class");
-  if (g_strcmp0 (class, "modem"))
-    return;
+/**************** Flight recorder events ****************/
+
+/** The hot paths record these instead of formatting debug
+    messages; see wys_flight_dump() */
+static const WysFlightKind FLIGHT_CACHE_INSERT =
+  { "cache_insert",   { "kind", NULL },          { "index", NULL },    "name" };
+static const WysFlightKind FLIGHT_CACHE_REMOVE =
+  { "cache_remove",   { "kind", NULL },          { "index", NULL },    NULL };
+static const WysFlightKind FLIGHT_LIST_END =
+  { "list_end",       { "kind", NULL },          { NULL, NULL },       NULL };
+static const WysFlightKind FLIGHT_FIND_LOOPBACK =
+  { "find_loopback",  { "direction", NULL },     { NULL, NULL },       "card" };
+static const WysFlightKind FLIGHT_LOOPBACK_FOUND =
+  { "loopback_found", { "direction", NULL },     { "module", NULL },   "card" };
+static const WysFlightKind FLIGHT_FIND_CARD =
+  { "find_card",      { "kind", NULL },          { NULL, NULL },       "card" };
+static const WysFlightKind FLIGHT_CARD_MATCH =
+  { "card_match",     { "kind", NULL },          { "index", NULL },    "name" };
+static const WysFlightKind FLIGHT_CARD_MISMATCH =
+  { "card_mismatch",  { "kind", NULL },          { "index", NULL },    "name" };
+static const WysFlightKind FLIGHT_CARD_SKIP =
+  { "card_skip",      { "kind", NULL },          { "index", NULL },    "name" };
+static const WysFlightKind FLIGHT_LOOPBACK_STATE =
+  { "loopback_state", { "direction", "state" },  { NULL, NULL },       "from" };
+static const WysFlightKind FLIGHT_LOOPBACK_WAIT =
+  { "loopback_wait",  { "direction", "for" },    { NULL, NULL },       NULL };
+static const WysFlightKind FLIGHT_LOOPBACK_DEFER =
+  { "loopback_defer", { "direction", "state" },  { NULL, NULL },       NULL };
+static const WysFlightKind FLIGHT_STANDBY_MUTE =
+  { "standby_mute",   { "kind", NULL },          { "index", "mute" },  NULL };
+static const WysFlightKind FLIGHT_LATENCY =
+  { "latency",        { "direction", NULL },     { "msec", "target", "over" },
+    NULL };
+static const WysFlightKind FLIGHT_SPAN_STAGE =
+  { "span_stage",     { "direction", "stage" },  { "usec", NULL },     NULL };
+
+
+static const gchar * const CACHE_KIND_NAMES[] =
+  {
+   [CACHE_SINK]          = "sink",
+   [CACHE_SOURCE]        = "source",
+   [CACHE_MODULE]        = "module",
+   [CACHE_SINK_INPUT]    = "sink input",
+   [CACHE_SOURCE_OUTPUT] = "source output",
+   [CACHE_CARD]          = "card"
+  };
+
+
+static struct cache_object *
+cache_object_new (uint32_t           index,
+                  const char        *name,
+                  const pa_proplist *proplist)
+{
+  struct cache_object *object;
 
-  alsa_card = pa_proplist_gets (info->proplist, "alsa.card_name");
-  if (!alsa_card)
-    return;
+  object = g_new0 (struct cache_object, 1);
+  object->index = index;
+  object->name = g_strdup (name);
+  object->proplist = proplist ? pa_proplist_copy (proplist) : NULL;
+  object->owner_module = PA_INVALID_INDEX;
+  object->device = PA_INVALID_INDEX;
+  object->card = PA_INVALID_INDEX;
 
-  g_debug ("Found card '%s', alsa: '%s'", info->name, alsa_card);
-  self->modem = g_strdup (alsa_card);
+  return object;
 }
 
 
 static void
-context_notify_cb (pa_context *audio, WysAudio *self)
+cache_object_free (struct cache_object *object)
 {
-  pa_context_state_t audio_state;
-  pa_operation *op;
-
-  audio_state = pa_context_get_state (audio);
-  switch (audio_state)
+  if (object->proplist)
     {
-    case PA_CONTEXT_UNCONNECTED:
-    case PA_CONTEXT_CONNECTING:
-    case PA_CONTEXT_AUTHORIZING:
-    case PA_CONTEXT_SETTING_NAME:
-      self->ready = FALSE;
-      break;
-    case PA_CONTEXT_FAILED:
-      wys_error ("Error in PulseAudio context: %s",
-                  pa_strerror (pa_context_errno (audio)));
-      break;
-    case PA_CONTEXT_TERMINATED:
-    case PA_CONTEXT_READY:
-      self->ready = TRUE;
-      /* Find modem if there's none already */
-      if (!self->modem) {
-        op = pa_context_get_card_info_list(self->ctx, get_card_info_cb, self);
-        if (op)
-          pa_operation_unref(op);
-      }
-      break;
+      pa_proplist_free (object->proplist);
     }
+  g_free (object->name);
+  g_free (object);
 }
 
 
 static void
-set_up_audio_context (WysAudio *self)
+cache_insert (WysAudio            *self,
+              enum cache_kind      kind,
+              struct cache_object *object)
 {
-  pa_proplist *props;
-  int err;
-
-  /* Meta data */
-  props = pa_proplist_new ();
-  g_assert (props != NULL);
+  wys_flight_record (&FLIGHT_CACHE_INSERT, CACHE_KIND_NAMES[kind], NULL,
+                     object->index, 0, 0, object->name);
 
-  proplist_set (props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
-  proplist_set (props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+  g_hash_table_replace (self->cache[kind],
+                        GUINT_TO_POINTER (object->index),
+                        object);
 
-  self->loop = pa_glib_mainloop_new (NULL);
-  if (!self->loop)
-    {
-      wys_error ("Error creating PulseAudio main loop");
-    }
+  modem_object_added (self, kind, object);
 
-  self->ctx = pa_context_new_with_proplist (pa_glib_mainloop_get_api (self->loop),
-                                            APPLICATION_NAME, props);
-  if (!self->ctx)
+  if (kind == CACHE_SINK_INPUT || kind == CACHE_SOURCE_OUTPUT)
     {
-      wys_error ("Error creating PulseAudio context");
+      span_streams_check (self, WYS_DIRECTION_FROM_NETWORK);
+      span_streams_check (self, WYS_DIRECTION_TO_NETWORK);
     }
 
-  pa_context_set_state_callback (self->ctx,
-                                 (pa_context_notify_cb_t)context_notify_cb,
-                                 self);
-  err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
-  if (err < 0)
+  if (self->standby
+      && object->owner_module != PA_INVALID_INDEX)
     {
-      wys_error ("Error connecting PulseAudio context: %s",
-                  pa_strerror (err));
+      if (object->owner_module == self->loopbacks[WYS_DIRECTION_FROM_NETWORK].module)
+        {
+          standby_apply (self, WYS_DIRECTION_FROM_NETWORK);
+        }
+      else if (object->owner_module == self->loopbacks[WYS_DIRECTION_TO_NETWORK].module)
+        {
+          standby_apply (self, WYS_DIRECTION_TO_NETWORK);
+        }
     }
+}
 
-  while (!self->ready)
-    {
-      g_main_context_iteration (NULL, TRUE);
-    }
 
-  pa_context_set_state_callback (self->ctx, NULL, NULL);
-  pa_proplist_free (props);
+static inline struct cache_object *
+cache_lookup (WysAudio        *self,
+              enum cache_kind  kind,
+              uint32_t         index)
+{
+  return g_hash_table_lookup (self->cache[kind],
+                              GUINT_TO_POINTER (index));
 }
 
 
 static void
-set_property (GObject      *object,
-              guint         property_id,
-              const GValue *value,
-              GParamSpec   *pspec)
+cache_clear (WysAudio *self)
 {
-  WysAudio *self = WYS_AUDIO (object);
+  guint kind;
 
-  switch (property_id) {
-  case PROP_MODEM:
-    self->modem = g_value_dup_string (value);
-    break;
+  for (kind = 0; kind < CACHE_LAST; ++kind)
+    {
+      g_hash_table_remove_all (self->cache[kind]);
+    }
 
-  default:
-    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-    break;
-  }
+  self->cache_pending = 0;
+  self->cache_synced = FALSE;
 }
 
 
-static void
-constructed (GObject *object)
+static struct cache_object *
+cache_object_new_sink (const pa_sink_info *info)
 {
-  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
-  WysAudio *self = WYS_AUDIO (object);
+  struct cache_object *object;
 
-  set_up_audio_context (self);
+  object = cache_object_new (info->index, info->name, info->proplist);
+  object->owner_module = info->owner_module;
+  object->sample_spec = info->sample_spec;
+  object->card = info->card;
 
-  parent_class->constructed (object);
+  return object;
 }
 
 
-static void
-dispose (GObject *object)
+static struct cache_object *
+cache_object_new_source (const pa_source_info *info)
 {
-  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
-  WysAudio *self = WYS_AUDIO (object);
-
-  if (self->ctx)
-    {
-      pa_context_disconnect (self->ctx);
-      pa_context_unref (self->ctx);
-      self->ctx = NULL;
-
-      pa_glib_mainloop_free (self->loop);
-      self->loop = NULL;
-    }
+  struct cache_object *object;
 
+  object = cache_object_new (info->index, info->name, info->proplist);
+  object->owner_module = info->owner_module;
+  object->sample_spec = info->sample_spec;
+  object->card = info->card;
 
-  parent_class->dispose (object);
+  return object;
 }
 
 
-static void
-finalize (GObject *object)
+static struct cache_object *
+cache_object_new_module (const pa_module_info *info)
 {
-  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
-  WysAudio *self = WYS_AUDIO (object);
-
-  g_free (self->modem);
-
-  parent_class->finalize (object);
+  return cache_object_new (info->index, info->name, info->proplist);
 }
 
 
-static void
-wys_audio_class_init (WysAudioClass *klass)
+static struct cache_object *
+cache_object_new_sink_input (const pa_sink_input_info *info)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  struct cache_object *object;
 
-  object_class->set_property = set_property;
-  object_class->constructed  = constructed;
-  object_class->dispose      = dispose;
-  object_class->finalize     = finalize;
-
-  props[PROP_MODEM] =
-    g_param_spec_string ("modem",
-                         _("Modem"),
-                         _("The ALSA card name for the modem"),
-                         NULL,
-                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+  object = cache_object_new (info->index, info->name, info->proplist);
+  object->owner_module = info->owner_module;
+  object->device = info->sink;
+  object->sample_spec = info->sample_spec;
+  object->mute = info->mute;
 
-  g_object_class_install_properties (object_class, PROP_LAST_PROP, props);
+  return object;
 }
 
 
-static void
-wys_audio_init (WysAudio *self)
+static struct cache_object *
+cache_object_new_source_output (const pa_source_output_info *info)
 {
-}
+  struct cache_object *object;
 
+  object = cache_object_new (info->index, info->name, info->proplist);
+  object->owner_module = info->owner_module;
+  object->device = info->source;
+  object->sample_spec = info->sample_spec;
+  object->mute = info->mute;
 
-WysAudio *
-wys_audio_new (const gchar *modem)
-{
-  return g_object_new (WYS_TYPE_AUDIO,
-                       "modem", modem,
-                       NULL);
+  return object;
 }
 
 
-/**************** Get single info ****************/
-
-struct callback_data
+static struct cache_object *
+cache_object_new_card (const pa_card_info *info)
 {
-  GCallback callback;
-  gpointer userdata;
-};
-
+  return cache_object_new (info->index, info->name, info->proplist);
+}
 
-#define GET_SINGLE_INFO_CALLBACK(SingleInfo, single_info)       \
-  typedef void (*Get##SingleInfo##Callback)                     \
-  (pa_context *ctx,                                             \
-   const pa_##single_info##_info *info,                         \
-   gpointer userdata);
 
+static void
+cache_list_done (WysAudio *self)
+{
+  g_assert (self->cache_pending > 0);
 
-#define GET_SINGLE_INFO_CB(SingleInfo, single_info)             \
-  static void                                                   \
-  get_##single_info##_cb (pa_context *ctx,                      \
-                          const pa_##single_info##_info *info,  \
-                          int eol,                              \
-                          void *userdata)                       \
-  {                                                             \
-    struct callback_data *data = userdata;                      \
-    Get##SingleInfo##Callback func;                             \
-                                                                \
-    if (eol == -1)                                              \
-      {                                                         \
-        wys_error ("Error getting PulseAudio "                  \
-                   #single_info ": %s",                         \
-                   pa_strerror (pa_context_errno (ctx)));       \
-      }                                                         \
-                                                                \
-    if (eol)                                                    \
-      {                                                         \
-        if (data->callback)                                     \
-          {                                                     \
-            func = (Get##SingleInfo##Callback)data->callback;   \
-            func (ctx, NULL, data->userdata);                   \
-          }                                                     \
-                                                                \
-        g_free (data);                                          \
-        return;                                                 \
-      }                                                         \
-                                                                \
-    g_assert (info != NULL);                                    \
-                                                                \
-    /* We should only be called once with data */               \
-    g_assert (data->callback != NULL);                          \
-                                                                \
-    func = (Get##SingleInfo##Callback)data->callback;           \
-    func (ctx, info, data->userdata);                           \
-                                                                \
-    data->callback = NULL;                                      \
-  }
+  --self->cache_pending;
+  if (self->cache_pending == 0)
+    {
+      g_debug ("PulseAudio object cache synchronised");
+      self->cache_synced = TRUE;
+      self->reconnect_delay = 0;
+      update_loopbacks (self);
+      g_signal_emit (self, signals[SIGNAL_READY], 0);
+    }
+}
 
 
-#define GET_SINGLE_INFO(single_info, single_info_func)  \
-  static void                                           \
-  get_##single_info (pa_context *ctx,                   \
-                     uint32_t index,                    \
-                     GCallback callback,                \
-                     gpointer userdata)                 \
-  {                                                     \
-    pa_operation *op;                                   \
-    struct callback_data *data;                         \
-                                                        \
-    data = g_new (struct callback_data, 1);             \
-    data->callback = callback;                          \
-    data->userdata = userdata;                          \
-                                                        \
-    op = pa_context_get_##single_info_func              \
-      (ctx,                                             \
-       index,                                           \
-       get_##single_info##_cb,                          \
-       data);                                           \
-                                                        \
-    pa_operation_unref (op);                            \
+/** Callbacks for the initial listing of each kind of object and for
+    getting single objects after a subscription event.  An error on a
+    single object is expected when the object has gone away between
+    the event and our query; the removal event will follow. */
+#define CACHE_INFO_CB(object_type, KIND)                                \
+  static void                                                           \
+  cache_##object_type##_list_cb (pa_context *ctx,                       \
+                                 const pa_##object_type##_info *info,   \
+                                 int eol,                               \
+                                 void *userdata)                        \
+  {                                                                     \
+    WysAudio *self = userdata;                                          \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        TRACE_OP_END ("get_" #object_type "_info_list", self);          \
+      }                                                                 \
+                                                                        \
+    if (!self->ready)                                                   \
+      {                                                                 \
+        /* A list on a context we have given up on */                   \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (eol == -1)                                                      \
+      {                                                                 \
+        /* Without the whole list the cache can never be                \
+           synchronised; start over on a new context */                 \
+        g_warning ("Error listing PulseAudio " #object_type "s: %s",    \
+                   pa_strerror (pa_context_errno (ctx)));               \
+        schedule_reconnect (self);                                      \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        cache_list_done (self);                                         \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    cache_insert (self, KIND,                                           \
+                  cache_object_new_##object_type (info));               \
+  }                                                                     \
+                                                                        \
+  static void                                                           \
+  cache_##object_type##_cb (pa_context *ctx,                            \
+                            const pa_##object_type##_info *info,        \
+                            int eol,                                    \
+                            void *userdata)                             \
+  {                                                                     \
+    WysAudio *self = userdata;                                          \
+                                                                        \
+    if (eol == -1)                                                      \
+      {                                                                 \
+        g_debug ("Error getting PulseAudio " #object_type ": %s",       \
+                 pa_strerror (pa_context_errno (ctx)));                 \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    wys_trace_async_end ("pulse", "get_" #object_type "_info",          \
+                         CACHE_TRACE_ID (KIND, info->index));           \
+    cache_insert (self, KIND,                                           \
+                  cache_object_new_##object_type (info));               \
   }
 
 
-#define DECLARE_GET_SINGLE_INFO(SingleInfo, single_info, single_info_func) \
-  GET_SINGLE_INFO_CALLBACK(SingleInfo, single_info)                     \
-  GET_SINGLE_INFO_CB(SingleInfo, single_info)                           \
-  GET_SINGLE_INFO(single_info, single_info_func)
+CACHE_INFO_CB(sink,          CACHE_SINK);
+CACHE_INFO_CB(source,        CACHE_SOURCE);
+CACHE_INFO_CB(module,        CACHE_MODULE);
+CACHE_INFO_CB(sink_input,    CACHE_SINK_INPUT);
+CACHE_INFO_CB(source_output, CACHE_SOURCE_OUTPUT);
+CACHE_INFO_CB(card,          CACHE_CARD);
 
 
-DECLARE_GET_SINGLE_INFO(Source, source, source_info_by_index);
-DECLARE_GET_SINGLE_INFO(Module, module, module_info);
-DECLARE_GET_SINGLE_INFO(Sink,   sink,   sink_info_by_index);
-
-
-/**************** PulseAudio properties ****************/
-
-static gboolean
-prop_matches (pa_proplist *props,
-              const gchar *key,
-              const gchar *needle)
+static void
+cache_update (WysAudio        *self,
+              enum cache_kind  kind,
+              uint32_t         index)
 {
-  const char *value;
+  static const gchar * const names[] =
+    {
+      "get_sink_info", "get_source_info", "get_module_info",
+      "get_sink_input_info", "get_source_output_info", "get_card_info"
+    };
+  pa_operation *op = NULL;
 
-  value = pa_proplist_gets (props, key);
+  G_STATIC_ASSERT (G_N_ELEMENTS (names) == CACHE_LAST);
 
-  if (!value)
+  switch (kind)
     {
-      return FALSE;
+    case CACHE_SINK:
+      op = pa_context_get_sink_info_by_index
+        (self->ctx, index, cache_sink_cb, self);
+      break;
+    case CACHE_SOURCE:
+      op = pa_context_get_source_info_by_index
+        (self->ctx, index, cache_source_cb, self);
+      break;
+    case CACHE_MODULE:
+      op = pa_context_get_module_info
+        (self->ctx, index, cache_module_cb, self);
+      break;
+    case CACHE_SINK_INPUT:
+      op = pa_context_get_sink_input_info
+        (self->ctx, index, cache_sink_input_cb, self);
+      break;
+    case CACHE_SOURCE_OUTPUT:
+      op = pa_context_get_source_output_info
+        (self->ctx, index, cache_source_output_cb, self);
+      break;
+    case CACHE_CARD:
+      op = pa_context_get_card_info_by_index
+        (self->ctx, index, cache_card_cb, self);
+      break;
+    default:
+      g_assert_not_reached ();
     }
 
-  return strcmp (value, needle) == 0;
+  if (op)
+    {
+      /* An object that goes away before the query completes leaves
+         its event open */
+      wys_trace_async_begin ("pulse", names[kind],
+                             CACHE_TRACE_ID (kind, index));
+      pa_operation_unref (op);
+    }
 }
 
 
-static gboolean
-props_name_alsa_card (pa_proplist *props,
-                      const gchar *alsa_card)
+static void
+subscribe_cb (pa_context                   *ctx,
+              pa_subscription_event_type_t  type,
+              uint32_t                      index,
+              void                         *userdata)
 {
-#define check(key,val)                          \
-  if (!prop_matches (props, key, val))          \
-    {                                           \
-      return FALSE;                             \
-    }
+  WysAudio *self = WYS_AUDIO (userdata);
+  enum cache_kind kind;
 
-  check ("device.class",   "sound");
-  check ("device.api",     "alsa");
-  check ("alsa.card_name", alsa_card);
-
-#undef check
+  switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK)
+    {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+      kind = CACHE_SINK;
+      break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+      kind = CACHE_SOURCE;
+      break;
+    case PA_SUBSCRIPTION_EVENT_MODULE:
+      kind = CACHE_MODULE;
+      break;
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+      kind = CACHE_SINK_INPUT;
+      break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+      kind = CACHE_SOURCE_OUTPUT;
+      break;
+    case PA_SUBSCRIPTION_EVENT_CARD:
+      kind = CACHE_CARD;
+      break;
+    default:
+      return;
+    }
 
-  return TRUE;
+  if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK)
+      == PA_SUBSCRIPTION_EVENT_REMOVE)
+    {
+      wys_flight_record (&FLIGHT_CACHE_REMOVE, CACHE_KIND_NAMES[kind], NULL,
+                         index, 0, 0, NULL);
+      g_hash_table_remove (self->cache[kind],
+                           GUINT_TO_POINTER (index));
+
+      if (kind == CACHE_MODULE)
+        {
+          loopback_module_removed (self, index);
+          echo_cancel_module_removed (self, index);
+        }
+      else if (kind == CACHE_CARD)
+        {
+          modem_card_removed (self, index);
+        }
+    }
+  else
+    {
+      cache_update (self, kind, index);
+    }
 }
 
 
-/**************** Find loopback data ****************/
-
-typedef void (*FindLoopbackCallback) (gchar *alsa_card,
-                                      WysDirection direction,
-                                      GList *modules,
-                                      gpointer userdata);
-
-
-struct find_loopback_data
-{
-  gchar *alsa_card;
-  WysDirection direction;
-  GCallback callback;
-  gpointer userdata;
-  GList *modules;
-};
-
-
-static struct find_loopback_data *
-find_loopback_data_new (const gchar *alsa_card,
-                        WysDirection direction)
+static void
+subscribe_success_cb (pa_context *ctx,
+                      int         success,
+                      void       *userdata)
 {
-  struct find_loopback_data *data;
-
-  data = g_rc_box_new0 (struct find_loopback_data);
-  data->alsa_card = g_strdup (alsa_card);
-  data->direction = direction;
-
-  return data;
+  if (!success)
+    {
+      g_warning ("Error subscribing to PulseAudio events: %s",
+                 pa_strerror (pa_context_errno (ctx)));
+    }
 }
 
 
+/** Fill the object cache and keep it up to date.  We subscribe
+    before listing so that no change can fall between the list and
+    the subscription. */
 static void
-find_loopback_data_clear (struct find_loopback_data *data)
+cache_start (WysAudio *self)
 {
-  FindLoopbackCallback func = (FindLoopbackCallback)data->callback;
+  pa_operation *op;
 
-  func (data->alsa_card,
-        data->direction,
-        data->modules,
-        data->userdata);
+  cache_clear (self);
+
+  pa_context_set_subscribe_callback (self->ctx, subscribe_cb, self);
+  op = pa_context_subscribe (self->ctx,
+                             PA_SUBSCRIPTION_MASK_SINK
+                             | PA_SUBSCRIPTION_MASK_SOURCE
+                             | PA_SUBSCRIPTION_MASK_MODULE
+                             | PA_SUBSCRIPTION_MASK_SINK_INPUT
+                             | PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT
+                             | PA_SUBSCRIPTION_MASK_CARD,
+                             subscribe_success_cb, NULL);
+  if (!op)
+    {
+      g_warning ("Error subscribing to PulseAudio events: %s",
+                 pa_strerror (pa_context_errno (self->ctx)));
+      return;
+    }
+  pa_operation_unref (op);
 
-  g_list_free (data->modules);
-  g_free (data->alsa_card);
-}
+#define list(object_type, func)                                         \
+  op = pa_context_get_##func (self->ctx,                                \
+                              cache_##object_type##_list_cb, self);     \
+  if (op)                                                               \
+    {                                                                   \
+      TRACE_OP_BEGIN ("get_" #func, self);                              \
+      ++self->cache_pending;                                            \
+      pa_operation_unref (op);                                          \
+    }
 
+  list (sink,          sink_info_list);
+  list (source,        source_info_list);
+  list (module,        module_info_list);
+  list (sink_input,    sink_input_info_list);
+  list (source_output, source_output_info_list);
+  list (card,          card_info_list);
 
-static inline void
-find_loopback_data_release (struct find_loopback_data *data)
-{
-  g_rc_box_release_full (data, (GDestroyNotify)find_loopback_data_clear);
+#undef list
+
+  g_debug ("Filling PulseAudio object cache");
 }
 
 
-/**************** Loopback module data ****************/
+/**************** Modem card ****************/
 
-struct loopback_module_data
+static void
+modem_card_added (WysAudio            *self,
+                  struct cache_object *card)
 {
-  struct find_loopback_data *loopback_data;
-  uint32_t module_index;
-};
+  const char *alsa_card;
 
+  if (self->modem_card != PA_INVALID_INDEX)
+    {
+      return;
+    }
 
-static struct loopback_module_data *
-loopback_module_data_new (struct find_loopback_data *loopback_data,
-                          uint32_t module_index)
-{
-  struct loopback_module_data * module_data;
+  alsa_card = pa_proplist_gets (card->proplist, "alsa.card_name");
+  if (!alsa_card)
+    {
+      return;
+    }
 
-  module_data = g_rc_box_new0 (struct loopback_module_data);
-  module_data->module_index = module_index;
+  if (self->modem_configured)
+    {
+      if (strcmp (alsa_card, self->modem) != 0)
+        {
+          return;
+        }
+    }
+  else
+    {
+      if (g_strcmp0 (pa_proplist_gets (card->proplist, "device.class"),
+                     "modem") != 0
+          || g_hash_table_contains (self->excluded_cards, alsa_card))
+        {
+          return;
+        }
+
+      g_free (self->modem);
+      self->modem = g_strdup (alsa_card);
+    }
 
-  g_rc_box_acquire (loopback_data);
-  module_data->loopback_data = loopback_data;
+  g_debug ("Found modem card %" PRIu32 " `%s', ALSA card `%s'",
+           card->index, card->name, alsa_card);
+  self->modem_card = card->index;
 
-  return module_data;
+  /* The initial synchronisation updates the loopbacks when it's
+     done */
+  if (self->cache_synced)
+    {
+      update_loopbacks (self);
+    }
 }
 
 
-static inline void
-loopback_module_data_clear (struct loopback_module_data *module_data)
+/** Called for each object entering the cache.  Besides looking out
+    for the modem card, we retry any wanted loopbacks when one of the
+    modem's devices appears, since the card's sinks and sources may
+    only be created after the card itself. */
+static void
+modem_object_added (WysAudio            *self,
+                    enum cache_kind      kind,
+                    struct cache_object *object)
 {
-  find_loopback_data_release (module_data->loopback_data);
-}
+  switch (kind)
+    {
+    case CACHE_CARD:
+      modem_card_added (self, object);
+      break;
 
+    case CACHE_SINK:
+    case CACHE_SOURCE:
+      if (self->cache_synced
+          && self->modem
+          && props_name_alsa_card (object->proplist, self->modem))
+        {
+          update_loopbacks (self);
+        }
+      break;
 
-static inline void
-loopback_module_data_release (struct loopback_module_data *module_data)
-{
-  g_rc_box_release_full (module_data,
-                         (GDestroyNotify)loopback_module_data_clear);
+    default:
+      break;
+    }
 }
 
 
-/**************** Module ****************/
-
 static void
-find_loopback_get_module_cb (pa_context *ctx,
-                             const pa_module_info *info,
-                             struct loopback_module_data *module_data)
+modem_card_removed (WysAudio *self,
+                    uint32_t  index)
 {
-  struct find_loopback_data *loopback_data = module_data->loopback_data;
-
-  if (!info)
+  if (index == PA_INVALID_INDEX || index != self->modem_card)
     {
-      g_warning ("Could not get module %" PRIu32
-                 " for ALSA card `%s' %s",
-                 module_data->module_index,
-                 loopback_data->alsa_card,
-                 loopback_data->direction == WYS_DIRECTION_FROM_NETWORK ? "source output" : "sink input");
-      loopback_module_data_release (module_data);
       return;
     }
 
-  if (strcmp (info->name, "module-loopback") != 0)
+  g_debug ("Modem card %" PRIu32 " removed", index);
+  self->modem_card = PA_INVALID_INDEX;
+
+  if (!self->modem_configured)
     {
-      g_debug ("Module %" PRIu32 " for ALSA card `%s` %s"
-               " is not a loopback module",
-               info->index, loopback_data->alsa_card,
-               loopback_data->direction == WYS_DIRECTION_FROM_NETWORK ? "source output" : "sink input");
-      loopback_module_data_release (module_data);
-      return;
+      g_clear_pointer (&self->modem, g_free);
     }
 
-
-  g_debug ("Module %" PRIu32 " for ALSA card `%s' %s is a"
-           " loopback module",
-           info->index, loopback_data->alsa_card,
-           loopback_data->direction == WYS_DIRECTION_FROM_NETWORK ? "source output" : "sink input");
-
-  loopback_data->modules = g_list_append
-    (loopback_data->modules,
-     GUINT_TO_POINTER (module_data->module_index));
-
-  loopback_module_data_release (module_data);
+  /* Our loopback modules go away with the card's sinks and sources
+     and the loopbacks become idle through the module removal events.
+     They're set up again as soon as the card comes back. */
 }
 
-/**************** Sink ****************/
 
-static void
-find_loopback_get_sink_cb (pa_context *ctx,
-                           const pa_sink_info *info,
-                           struct loopback_module_data *module_data)
+/** Leave @alsa_card to another instance.  Detection passes over it
+    from now on and, if we detected it ourselves, we let it go,
+    unload our loopbacks from it and look for another modem card. */
+void
+wys_audio_exclude_card (WysAudio    *self,
+                        const gchar *alsa_card)
 {
-  struct find_loopback_data *loopback_data = module_data->loopback_data;
+  GHashTableIter iter;
+  struct cache_object *card;
 
-  if (!info)
-    {
-      g_warning ("Couldn't find sink for sink input"
-                 " while finding ALSA card `%s' sink",
-                 loopback_data->alsa_card);
-      loopback_module_data_release (module_data);
-      return;
-    }
+  g_return_if_fail (WYS_IS_AUDIO (self));
+  g_return_if_fail (alsa_card != NULL);
 
-  if (!props_name_alsa_card (info->proplist,
-                             loopback_data->alsa_card))
+  g_hash_table_add (self->excluded_cards, g_strdup (alsa_card));
+
+  if (self->modem_configured || g_strcmp0 (self->modem, alsa_card) != 0)
     {
-      g_debug ("Sink %" PRIu32 " `%s' is not ALSA card `%s'",
-               info->index, info->name,
-               loopback_data->alsa_card);
-      loopback_module_data_release (module_data);
       return;
     }
 
+  g_debug ("Modem card %" PRIu32 " `%s' taken over, releasing it",
+           self->modem_card, alsa_card);
+  self->modem_card = PA_INVALID_INDEX;
+  g_clear_pointer (&self->modem, g_free);
 
-  g_debug ("Checking whether module %" PRIu32
-           " for ALSA card `%s' sink input"
-           " is a loopback module",
-           module_data->module_index,
-           loopback_data->alsa_card);
+  update_loopbacks (self);
+  echo_cancel_release (self);
 
-  get_module (ctx,
-              module_data->module_index,
-              G_CALLBACK (find_loopback_get_module_cb),
-              module_data);
+  g_hash_table_iter_init (&iter, self->cache[CACHE_CARD]);
+  while (self->modem_card == PA_INVALID_INDEX
+         && g_hash_table_iter_next (&iter, NULL, (gpointer *)&card))
+    {
+      modem_card_added (self, card);
+    }
 }
 
-/**************** Sink input list ****************/
 
 static void
-find_loopback_sink_input_list_cb (pa_context *ctx,
-                                  const pa_sink_input_info *info,
-                                  int eol,
-                                  void *userdata)
+context_notify_cb (pa_context *audio, WysAudio *self)
 {
-  struct find_loopback_data *loopback_data = userdata;
-  struct loopback_module_data *module_data;
+  pa_context_state_t audio_state;
 
-  if (eol == -1)
+  audio_state = pa_context_get_state (audio);
+  switch (audio_state)
     {
-      wys_error ("Error listing PulseAudio source outputs: %s",
-                 pa_strerror (pa_context_errno (ctx)));
+    case PA_CONTEXT_UNCONNECTED:
+    case PA_CONTEXT_CONNECTING:
+    case PA_CONTEXT_AUTHORIZING:
+    case PA_CONTEXT_SETTING_NAME:
+      self->ready = FALSE;
+      break;
+    case PA_CONTEXT_FAILED:
+      wys_trace_instant ("pulse", "context_failed");
+      g_warning ("Error in PulseAudio context: %s",
+                 pa_strerror (pa_context_errno (audio)));
+      schedule_reconnect (self);
+      break;
+    case PA_CONTEXT_TERMINATED:
+      self->ready = FALSE;
+      break;
+    case PA_CONTEXT_READY:
+      g_debug ("PulseAudio context ready");
+      wys_trace_instant ("pulse", "context_ready");
+      self->ready = TRUE;
+      cache_start (self);
+      /* Act on any audio that appeared while we were connecting */
+      update_loopbacks (self);
+      break;
     }
+}
 
-  if (eol)
+
+static void
+connect_context (WysAudio *self)
+{
+  pa_proplist *props;
+  int err;
+
+  /* Meta data */
+  props = pa_proplist_new ();
+  g_assert (props != NULL);
+
+  proplist_set (props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
+  proplist_set (props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+
+  self->ctx = pa_context_new_with_proplist (pa_glib_mainloop_get_api (self->loop),
+                                            APPLICATION_NAME, props);
+  pa_proplist_free (props);
+  if (!self->ctx)
     {
-      g_debug ("End of sink input list reached");
-      find_loopback_data_release (loopback_data);
-      return;
+      wys_error ("Error creating PulseAudio context");
     }
 
-  if (info->owner_module == PA_INVALID_INDEX)
+  pa_context_set_state_callback (self->ctx,
+                                 (pa_context_notify_cb_t)context_notify_cb,
+                                 self);
+  err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
+  if (err < 0)
     {
-      g_debug ("Sink input %" PRIu32 " `%s'"
-               " is not owned by a module",
-               info->index, info->name);
-      return;
+      g_warning ("Error connecting PulseAudio context: %s",
+                 pa_strerror (pa_context_errno (self->ctx)));
+      schedule_reconnect (self);
     }
 
-  module_data = loopback_module_data_new (loopback_data,
-                                          info->owner_module);
-
-  g_debug ("Getting sink %" PRIu32
-           " of sink input %" PRIu32 " `%s'",
-           info->sink, info->index, info->name);
-  get_sink (ctx,
-              info->sink,
-              G_CALLBACK (find_loopback_get_sink_cb),
-              module_data);
+  /* We don't wait for the connection here; the state callback
+     carries on when the context is ready and the "ready" signal is
+     emitted once the object cache is filled */
 }
 
-/**************** Source ****************/
 
 static void
-find_loopback_get_source_cb (pa_context *ctx,
-                             const pa_source_info *info,
-                             struct loopback_module_data *module_data)
+clear_context (WysAudio *self)
 {
-  struct find_loopback_data *loopback_data = module_data->loopback_data;
-
-  if (!info)
+  if (!self->ctx)
     {
-      g_warning ("Couldn't find source for source output"
-                 " while finding ALSA card `%s' source",
-                 loopback_data->alsa_card);
-      loopback_module_data_release (module_data);
       return;
     }
 
-  if (!props_name_alsa_card (info->proplist,
-                             loopback_data->alsa_card))
-    {
-      g_debug ("Source %" PRIu32 " `%s' is not ALSA card `%s'",
-               info->index, info->name,
-               loopback_data->alsa_card);
-      loopback_module_data_release (module_data);
-      return;
-    }
+  pa_context_set_state_callback (self->ctx, NULL, NULL);
+  pa_context_set_subscribe_callback (self->ctx, NULL, NULL);
+  pa_context_disconnect (self->ctx);
+  pa_context_unref (self->ctx);
+  self->ctx = NULL;
+}
+
 
+static gboolean
+reconnect_cb (WysAudio *self)
+{
+  self->reconnect_id = 0;
 
-  g_debug ("Checking whether module %" PRIu32
-           " for ALSA card `%s' source output"
-           " is a loopback module",
-           module_data->module_index,
-           loopback_data->alsa_card);
+  g_debug ("Reconnecting to PulseAudio");
+  clear_context (self);
+  connect_context (self);
 
-  get_module (ctx,
-              module_data->module_index,
-              G_CALLBACK (find_loopback_get_module_cb),
-              module_data);
+  return G_SOURCE_REMOVE;
 }
 
 
-/**************** Find loopback (source output list) ****************/
-
+/** Forget everything we knew through the failed context and try to
+    connect again after a delay.  Our loopback modules may well have
+    survived if only our connection was lost; if so, we find and
+    take them over again once we're reconnected. */
 static void
-find_loopback_source_output_list_cb (pa_context *ctx,
-                                     const pa_source_output_info *info,
-                                     int eol,
-                                     void *userdata)
+schedule_reconnect (WysAudio *self)
 {
-  struct find_loopback_data *loopback_data = userdata;
-  struct loopback_module_data *module_data;
+  WysDirection direction;
 
-  if (eol == -1)
+  self->ready = FALSE;
+  if (self->ctx)
     {
-      wys_error ("Error listing PulseAudio source outputs: %s",
-                 pa_strerror (pa_context_errno (ctx)));
+      /* The context may still be up if only listing failed.  Drop
+         it now, so that its operations are cancelled as the resets
+         below expect and their callbacks don't follow. */
+      pa_context_set_state_callback (self->ctx, NULL, NULL);
+      pa_context_set_subscribe_callback (self->ctx, NULL, NULL);
+      pa_context_disconnect (self->ctx);
     }
+  /* Card indices don't survive a restart of the server */
+  modem_card_removed (self, self->modem_card);
+  cache_clear (self);
 
-  if (eol)
+  for (direction = WYS_DIRECTION_FROM_NETWORK;
+       direction <= WYS_DIRECTION_TO_NETWORK;
+       ++direction)
     {
-      g_debug ("End of source output list reached");
-      find_loopback_data_release (loopback_data);
-      return;
+      loopback_reset (self, direction);
     }
+  echo_cancel_reset (self);
 
-  if (info->owner_module == PA_INVALID_INDEX)
+  if (self->reconnect_id != 0)
     {
-      g_debug ("Source output %" PRIu32 " `%s'"
-               " is not owned by a module",
-               info->index, info->name);
       return;
     }
 
-  module_data = loopback_module_data_new (loopback_data,
-                                          info->owner_module);
+  self->reconnect_delay =
+    CLAMP (self->reconnect_delay * 2,
+           RECONNECT_MIN_MSEC, RECONNECT_MAX_MSEC);
 
-  g_debug ("Getting source %" PRIu32
-           " of source output %" PRIu32 " `%s'",
-           info->source, info->index, info->name);
-  get_source (ctx,
-              info->source,
-              G_CALLBACK (find_loopback_get_source_cb),
-              module_data);
-}
+  g_debug ("Reconnecting to PulseAudio in %ums",
+           self->reconnect_delay);
 
+  self->reconnect_id =
+    g_timeout_add (self->reconnect_delay,
+                   (GSourceFunc)reconnect_cb, self);
+}
 
-/** Find any loopback module for the specified source or sink
-    alsa card.
 
-    1. Loop through all source outputs / sink outputs.
-      1. Skip any source output / sink input that doesn't have the specified
-      alsa card as its source.
-      2. Skip any source output / sink input that isn't a loopback module.
-      3. Found a loopback.
-*/
 static void
-find_loopback (pa_context *ctx,
-               const gchar *alsa_card,
-               WysDirection direction,
-               GCallback callback,
-               gpointer userdata)
+set_up_audio_context (WysAudio *self)
 {
-  struct find_loopback_data *data;
-  pa_operation *op;
-
-  data = find_loopback_data_new (alsa_card, direction);
-  data->callback = callback;
-  data->userdata = userdata;
-
-  switch (direction)
+  self->loop = pa_glib_mainloop_new (NULL);
+  if (!self->loop)
     {
-    case WYS_DIRECTION_FROM_NETWORK:
-      g_debug ("Finding ALSA card `%s' source output",
-               alsa_card);
-      op = pa_context_get_source_output_info_list
-        (ctx, find_loopback_source_output_list_cb, data);
-      pa_operation_unref (op);
-      break;
-    case WYS_DIRECTION_TO_NETWORK:
-      g_debug ("Finding ALSA card `%s' sink input",
-               alsa_card);
-      op = pa_context_get_sink_input_info_list
-        (ctx, find_loopback_sink_input_list_cb, data);
-      pa_operation_unref (op);
-      break;
-    default:
-      break;
+      wys_error ("Error creating PulseAudio main loop");
     }
-}
-
-
-/**************** Find ALSA card data ****************/
-
-typedef void (*FindALSACardCallback) (const gchar *alsa_card_name,
-                                      const gchar *pulse_object_name,
-                                      gpointer userdata);
 
-struct find_alsa_card_data
-{
-  gchar *alsa_card_name;
-  GCallback callback;
-  gpointer userdata;
-  gchar *pulse_object_name;
-};
+  connect_context (self);
+}
 
 
-static struct find_alsa_card_data *
-find_alsa_card_data_new (const gchar *alsa_card_name)
+static void
+set_sample_format (WysAudio    *self,
+                   const gchar *format)
 {
-  struct find_alsa_card_data *data;
+  self->sample_format = PA_SAMPLE_INVALID;
 
-  data = g_rc_box_new0 (struct find_alsa_card_data);
-  data->alsa_card_name = g_strdup (alsa_card_name);
+  if (!format)
+    {
+      return;
+    }
 
-  return data;
+  self->sample_format = pa_parse_sample_format (format);
+  if (self->sample_format == PA_SAMPLE_INVALID)
+    {
+      g_warning ("Invalid sample format `%s', using the modem's",
+                 format);
+    }
 }
 
 
 static void
-find_alsa_card_data_clear (struct find_alsa_card_data *data)
+set_property (GObject      *object,
+              guint         property_id,
+              const GValue *value,
+              GParamSpec   *pspec)
 {
-  FindALSACardCallback func = (FindALSACardCallback)data->callback;
+  WysAudio *self = WYS_AUDIO (object);
 
-  func (data->alsa_card_name,
-        data->pulse_object_name,
-        data->userdata);
+  switch (property_id) {
+  case PROP_MODEM:
+    self->modem = g_value_dup_string (value);
+    self->modem_configured = (self->modem != NULL);
+    break;
 
-  g_free (data->pulse_object_name);
-  g_free (data->alsa_card_name);
-}
+  case PROP_STANDBY:
+    self->standby = g_value_get_boolean (value);
+    break;
 
+  case PROP_SAMPLE_FORMAT:
+    set_sample_format (self, g_value_get_string (value));
+    break;
 
-static inline void
-find_alsa_card_data_release (struct find_alsa_card_data *data)
+  case PROP_SAMPLE_RATE:
+    self->sample_rate = g_value_get_uint (value);
+    break;
+
+  case PROP_CHANNELS:
+    self->channels = g_value_get_uint (value);
+    break;
+
+  case PROP_RESAMPLE_METHOD:
+    self->resample_method = g_value_dup_string (value);
+    break;
+
+  case PROP_LATENCY:
+    self->target_latency = g_value_get_uint (value);
+    break;
+
+  case PROP_ADJUST_THRESHOLD:
+    self->adjust_threshold = g_value_get_uint (value);
+    break;
+
+  case PROP_ADJUST_TIME:
+    self->adjust_time = g_value_get_uint (value);
+    break;
+
+  case PROP_ADAPTIVE_LATENCY:
+    self->adaptive = g_value_get_boolean (value);
+    break;
+
+  case PROP_LATENCY_MIN:
+    self->latency_min = g_value_get_uint (value);
+    break;
+
+  case PROP_LATENCY_MAX:
+    self->latency_max = g_value_get_uint (value);
+    break;
+
+  case PROP_ECHO_CANCEL:
+    self->echo_cancel = g_value_get_boolean (value);
+    break;
+
+  case PROP_AEC_METHOD:
+    self->aec_method = g_value_dup_string (value);
+    break;
+
+  case PROP_AEC_ARGS:
+    self->aec_args = g_value_dup_string (value);
+    break;
+
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    break;
+  }
+}
+
+
+static void
+constructed (GObject *object)
+{
+  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
+  WysAudio *self = WYS_AUDIO (object);
+  WysDirection direction;
+
+  self->latency_min = MAX (self->latency_min, 1);
+  if (self->latency_max < self->latency_min)
+    {
+      g_warning ("Maximum latency %ums is below the minimum %ums",
+                 self->latency_max, self->latency_min);
+      self->latency_max = self->latency_min;
+    }
+
+  for (direction = WYS_DIRECTION_FROM_NETWORK;
+       direction <= WYS_DIRECTION_TO_NETWORK;
+       ++direction)
+    {
+      self->latency[direction].target =
+        CLAMP (self->target_latency
+               ? self->target_latency : LATENCY_INITIAL_MSEC,
+               self->latency_min, self->latency_max);
+    }
+
+  set_up_audio_context (self);
+
+  parent_class->constructed (object);
+}
+
+
+static void
+dispose (GObject *object)
+{
+  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
+  WysAudio *self = WYS_AUDIO (object);
+
+  g_clear_handle_id (&self->reconnect_id, g_source_remove);
+  g_clear_handle_id (&self->echo_cancel_retry_id, g_source_remove);
+  g_clear_handle_id (&self->latency[WYS_DIRECTION_FROM_NETWORK].sample_id,
+                     g_source_remove);
+  g_clear_handle_id (&self->latency[WYS_DIRECTION_TO_NETWORK].sample_id,
+                     g_source_remove);
+
+  if (self->loop)
+    {
+      loopback_discovery_cancel (self, WYS_DIRECTION_FROM_NETWORK);
+      loopback_discovery_cancel (self, WYS_DIRECTION_TO_NETWORK);
+      clear_context (self);
+
+      pa_glib_mainloop_free (self->loop);
+      self->loop = NULL;
+    }
+
+
+  parent_class->dispose (object);
+}
+
+
+static void
+finalize (GObject *object)
+{
+  GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
+  WysAudio *self = WYS_AUDIO (object);
+  guint kind;
+
+  for (kind = 0; kind < CACHE_LAST; ++kind)
+    {
+      g_hash_table_unref (self->cache[kind]);
+    }
+
+  telemetry_clear (&self->telemetry[WYS_DIRECTION_FROM_NETWORK]);
+  telemetry_clear (&self->telemetry[WYS_DIRECTION_TO_NETWORK]);
+
+  for (kind = 0; kind < SPAN_LAST; ++kind)
+    {
+      wys_histogram_free (self->span_stats[kind]);
+    }
+
+  g_free (self->aec_args);
+  g_free (self->aec_method);
+  g_free (self->resample_method);
+  g_free (self->loopbacks[WYS_DIRECTION_FROM_NETWORK].alsa_card);
+  g_free (self->loopbacks[WYS_DIRECTION_TO_NETWORK].alsa_card);
+  g_ptr_array_unref (self->loopbacks[WYS_DIRECTION_FROM_NETWORK].discovery);
+  g_ptr_array_unref (self->loopbacks[WYS_DIRECTION_TO_NETWORK].discovery);
+  g_free (self->modem);
+  g_hash_table_unref (self->excluded_cards);
+
+  parent_class->finalize (object);
+}
+
+
+static void
+wys_audio_class_init (WysAudioClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->set_property = set_property;
+  object_class->constructed  = constructed;
+  object_class->dispose      = dispose;
+  object_class->finalize     = finalize;
+
+  props[PROP_MODEM] =
+    g_param_spec_string ("modem",
+                         _("Modem"),
+                         _("The ALSA card name for the modem"),
+                         NULL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_STANDBY] =
+    g_param_spec_boolean ("standby",
+                          _("Standby"),
+                          _("Whether to keep muted loopbacks loaded between calls"),
+                          FALSE,
+                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_SAMPLE_FORMAT] =
+    g_param_spec_string ("sample-format",
+                         _("Sample format"),
+                         _("The sample format of the loopbacks, instead of the modem's"),
+                         NULL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_SAMPLE_RATE] =
+    g_param_spec_uint ("sample-rate",
+                       _("Sample rate"),
+                       _("The sample rate of the loopbacks, instead of the modem's"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_CHANNELS] =
+    g_param_spec_uint ("channels",
+                       _("Channels"),
+                       _("The channel count of the loopbacks, instead of the modem's"),
+                       0, PA_CHANNELS_MAX, 0,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_RESAMPLE_METHOD] =
+    g_param_spec_string ("resample-method",
+                         _("Resample method"),
+                         _("The PulseAudio resampler for the loopbacks"),
+                         NULL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_LATENCY] =
+    g_param_spec_uint ("latency",
+                       _("Latency"),
+                       _("The loopback latency, in milliseconds"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_ADJUST_THRESHOLD] =
+    g_param_spec_uint ("adjust-threshold",
+                       _("Adjust threshold"),
+                       _("The loopback fast adjustment threshold, in milliseconds"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_ADJUST_TIME] =
+    g_param_spec_uint ("adjust-time",
+                       _("Adjust time"),
+                       _("How often the loopback adjusts its rate, in seconds"),
+                       0, G_MAXUINT, 0,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_ADAPTIVE_LATENCY] =
+    g_param_spec_boolean ("adaptive-latency",
+                          _("Adaptive latency"),
+                          _("Whether to adapt the loopback latency to what the devices can sustain"),
+                          FALSE,
+                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_LATENCY_MIN] =
+    g_param_spec_uint ("latency-min",
+                       _("Minimum latency"),
+                       _("The lowest adaptive loopback latency, in milliseconds"),
+                       0, G_MAXUINT, 10,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_LATENCY_MAX] =
+    g_param_spec_uint ("latency-max",
+                       _("Maximum latency"),
+                       _("The highest adaptive loopback latency, in milliseconds"),
+                       0, G_MAXUINT, 100,
+                       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_ECHO_CANCEL] =
+    g_param_spec_boolean ("echo-cancel",
+                          _("Echo cancel"),
+                          _("Whether to keep an echo canceller loaded for the loopbacks"),
+                          FALSE,
+                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_AEC_METHOD] =
+    g_param_spec_string ("aec-method",
+                         _("AEC method"),
+                         _("The echo canceller implementation"),
+                         NULL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  props[PROP_AEC_ARGS] =
+    g_param_spec_string ("aec-args",
+                         _("AEC arguments"),
+                         _("Arguments for the echo canceller implementation"),
+                         NULL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, PROP_LAST_PROP, props);
+
+
+  /**
+   * WysAudio::ready:
+   * @self: The #WysAudio instance.
+   *
+   * This signal is emitted when the PulseAudio context is connected
+   * and the object cache has been filled.  It is emitted again each
+   * time we reconnect after losing the connection to PulseAudio.
+   */
+  signals[SIGNAL_READY] =
+    g_signal_new ("ready",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE,
+                  0);
+}
+
+
+static void
+wys_audio_init (WysAudio *self)
+{
+  guint kind;
+
+  self->loopbacks[WYS_DIRECTION_FROM_NETWORK].module = PA_INVALID_INDEX;
+  self->loopbacks[WYS_DIRECTION_TO_NETWORK].module   = PA_INVALID_INDEX;
+  self->loopbacks[WYS_DIRECTION_FROM_NETWORK].discovery =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)pa_operation_unref);
+  self->loopbacks[WYS_DIRECTION_TO_NETWORK].discovery =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)pa_operation_unref);
+  self->modem_card = PA_INVALID_INDEX;
+  self->excluded_cards = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+  self->sample_format = PA_SAMPLE_INVALID;
+  self->echo_cancel_module = PA_INVALID_INDEX;
+
+  telemetry_init (&self->telemetry[WYS_DIRECTION_FROM_NETWORK]);
+  telemetry_init (&self->telemetry[WYS_DIRECTION_TO_NETWORK]);
+
+  for (kind = 0; kind < SPAN_LAST; ++kind)
+    {
+      self->span_stats[kind] = wys_histogram_new ();
+    }
+
+  for (kind = 0; kind < CACHE_LAST; ++kind)
+    {
+      self->cache[kind] = g_hash_table_new_full
+        (g_direct_hash, g_direct_equal,
+         NULL, (GDestroyNotify)cache_object_free);
+    }
+}
+
+
+WysAudio *
+wys_audio_new (const gchar                    *modem,
+               gboolean                        standby,
+               const struct wys_audio_profile *profile)
+{
+  return g_object_new (WYS_TYPE_AUDIO,
+                       "modem", modem,
+                       "standby", standby,
+                       "sample-format", profile->sample_format,
+                       "sample-rate", profile->sample_rate,
+                       "channels", profile->channels,
+                       "resample-method", profile->resample_method,
+                       "latency", profile->latency,
+                       "adjust-threshold", profile->adjust_threshold,
+                       "adjust-time", profile->adjust_time,
+                       "adaptive-latency", profile->adaptive_latency,
+                       "latency-min", profile->latency_min,
+                       "latency-max", profile->latency_max,
+                       "echo-cancel", profile->echo_cancel,
+                       "aec-method", profile->aec_method,
+                       "aec-args", profile->aec_args,
+                       NULL);
+}
+
+
+/**************** PulseAudio properties ****************/
+
+static gboolean
+prop_matches (pa_proplist *props,
+              const gchar *key,
+              const gchar *needle)
+{
+  const char *value;
+
+  value = pa_proplist_gets (props, key);
+
+  if (!value)
+    {
+      return FALSE;
+    }
+
+  return strcmp (value, needle) == 0;
+}
+
+
+static gboolean
+props_name_alsa_card (pa_proplist *props,
+                      const gchar *alsa_card)
+{
+#define check(key,val)                          \
+  if (!prop_matches (props, key, val))          \
+    {                                           \
+      return FALSE;                             \
+    }
+
+  check ("device.class",   "sound");
+  check ("device.api",     "alsa");
+  check ("alsa.card_name", alsa_card);
+
+#undef check
+
+  return TRUE;
+}
+
+
+/**************** Find loopback join ****************/
+
+/** Find the loopback modules for the specified source or sink ALSA
+    card, given maps of indices to struct cache_object for the
+    relevant streams (source outputs / sink inputs), devices (sources
+    / sinks) and modules.  Returns a list of module indices.
+
+    1. Loop through all source outputs / sink inputs.
+      1. Skip any source output / sink input that doesn't have the specified
+      alsa card as its source / sink.
+      2. Skip any source output / sink input that isn't owned by a loopback
+      module.
+      3. Found a loopback.
+*/
+static GList *
+join_loopback (GHashTable   *streams,
+               GHashTable   *devices,
+               GHashTable   *modules,
+               const gchar  *alsa_card,
+               WysDirection  direction)
+{
+  GHashTableIter iter;
+  struct cache_object *stream, *device, *module;
+  GList *loopbacks = NULL;
+
+  g_hash_table_iter_init (&iter, streams);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&stream))
+    {
+      if (stream->owner_module == PA_INVALID_INDEX)
+        {
+          continue;
+        }
+
+      device = g_hash_table_lookup (devices,
+                                    GUINT_TO_POINTER (stream->device));
+      if (!device || !props_name_alsa_card (device->proplist, alsa_card))
+        {
+          continue;
+        }
+
+      module = g_hash_table_lookup (modules,
+                                    GUINT_TO_POINTER (stream->owner_module));
+      if (!module || strcmp (module->name, "module-loopback") != 0)
+        {
+          continue;
+        }
+
+      wys_flight_record (&FLIGHT_LOOPBACK_FOUND,
+                         wys_direction_get_description (direction), NULL,
+                         module->index, 0, 0, alsa_card);
+
+      loopbacks = g_list_prepend (loopbacks,
+                                  GUINT_TO_POINTER (module->index));
+    }
+
+  return loopbacks;
+}
+
+
+static GList *
+cache_find_loopback (WysAudio     *self,
+                     const gchar  *alsa_card,
+                     WysDirection  direction)
+{
+  if (direction == WYS_DIRECTION_FROM_NETWORK)
+    {
+      return join_loopback (self->cache[CACHE_SOURCE_OUTPUT],
+                            self->cache[CACHE_SOURCE],
+                            self->cache[CACHE_MODULE],
+                            alsa_card, direction);
+    }
+  else
+    {
+      return join_loopback (self->cache[CACHE_SINK_INPUT],
+                            self->cache[CACHE_SINK],
+                            self->cache[CACHE_MODULE],
+                            alsa_card, direction);
+    }
+}
+
+
+/**************** Loopback discovery ****************/
+
+/** Start tracking a discovery for the loopback in the specified
+    direction.  There is only ever one at a time; the result of any
+    older one would be stale by now. */
+static void
+loopback_discovery_begin (WysAudio       *self,
+                          WysDirection    direction,
+                          gpointer        data,
+                          GDestroyNotify  cancel)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+
+  loopback_discovery_cancel (self, direction);
+  loopback->discovery_data = data;
+  loopback->discovery_cancel = cancel;
+}
+
+
+static inline void
+loopback_discovery_add (WysAudio     *self,
+                        WysDirection  direction,
+                        pa_operation *op)
+{
+  g_ptr_array_add (self->loopbacks[direction].discovery,
+                   pa_operation_ref (op));
+}
+
+
+/** Called once all of a discovery's operations have completed,
+    before its result is used */
+static void
+loopback_discovery_end (WysAudio     *self,
+                        WysDirection  direction,
+                        gpointer      data)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+
+  if (loopback->discovery_data != data)
+    {
+      return;
+    }
+
+  g_ptr_array_set_size (loopback->discovery, 0);
+  loopback->discovery_data = NULL;
+  loopback->discovery_cancel = NULL;
+}
+
+
+/** Cancel any discovery in progress for the loopback.  The callback
+    of a cancelled operation is never called, so we drop the
+    reference it held on the discovery data ourselves.  That goes
+    too for operations the context cancelled when it went away. */
+static void
+loopback_discovery_cancel (WysAudio     *self,
+                           WysDirection  direction)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+  gpointer data = loopback->discovery_data;
+  GDestroyNotify cancel = loopback->discovery_cancel;
+  GPtrArray *ops;
+  guint i;
+
+  if (!data)
+    {
+      return;
+    }
+
+  g_debug ("Cancelling loopback %s discovery",
+           wys_direction_get_description (direction));
+
+  /* Dropping the last reference ends the discovery, so take it out
+     of the way first */
+  ops = loopback->discovery;
+  loopback->discovery =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)pa_operation_unref);
+  loopback->discovery_data = NULL;
+  loopback->discovery_cancel = NULL;
+
+  for (i = 0; i < ops->len; ++i)
+    {
+      pa_operation *op = g_ptr_array_index (ops, i);
+
+      if (pa_operation_get_state (op) == PA_OPERATION_RUNNING)
+        {
+          pa_operation_cancel (op);
+        }
+
+      if (pa_operation_get_state (op) != PA_OPERATION_DONE)
+        {
+          cancel (data);
+        }
+    }
+
+  g_ptr_array_unref (ops);
+}
+
+
+/**************** Find loopback data ****************/
+
+typedef void (*FindLoopbackCallback) (gchar *alsa_card,
+                                      WysDirection direction,
+                                      GList *modules,
+                                      gpointer userdata);
+
+
+struct find_loopback_data
+{
+  WysAudio *self;
+  gchar *alsa_card;
+  WysDirection direction;
+  GCallback callback;
+  gpointer userdata;
+  /** Frees the userdata instead of calling the callback if the
+      discovery is cancelled, or NULL */
+  GDestroyNotify destroy;
+  gboolean cancelled;
+  GList *modules;
+  /** When querying the server, maps of indices to struct
+      cache_object for each of the lists we requested */
+  GHashTable *streams;
+  GHashTable *devices;
+  GHashTable *module_objects;
+};
+
+
+static inline GHashTable *
+object_table_new ()
+{
+  return g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                NULL, (GDestroyNotify)cache_object_free);
+}
+
+
+static struct find_loopback_data *
+find_loopback_data_new (WysAudio *self,
+                        const gchar *alsa_card,
+                        WysDirection direction)
+{
+  struct find_loopback_data *data;
+
+  data = g_rc_box_new0 (struct find_loopback_data);
+  data->self = self;
+  data->alsa_card = g_strdup (alsa_card);
+  data->direction = direction;
+
+  WYS_PROBE2 (find_loopback_start, data->alsa_card, direction);
+
+  return data;
+}
+
+
+static void
+find_loopback_data_clear (struct find_loopback_data *data)
+{
+  FindLoopbackCallback func = (FindLoopbackCallback)data->callback;
+
+  loopback_discovery_end (data->self, data->direction, data);
+
+  if (data->streams)
+    {
+      if (!data->cancelled)
+        {
+          data->modules = join_loopback (data->streams,
+                                         data->devices,
+                                         data->module_objects,
+                                         data->alsa_card,
+                                         data->direction);
+        }
+
+      g_hash_table_unref (data->module_objects);
+      g_hash_table_unref (data->devices);
+      g_hash_table_unref (data->streams);
+    }
+
+  WYS_PROBE3 (find_loopback_done, data->alsa_card, data->direction,
+              data->modules != NULL);
+
+  if (!data->cancelled)
+    {
+      func (data->alsa_card,
+            data->direction,
+            data->modules,
+            data->userdata);
+    }
+  else if (data->destroy)
+    {
+      data->destroy (data->userdata);
+    }
+
+  g_list_free (data->modules);
+  g_free (data->alsa_card);
+}
+
+
+static inline void
+find_loopback_data_release (struct find_loopback_data *data)
+{
+  g_rc_box_release_full (data, (GDestroyNotify)find_loopback_data_clear);
+}
+
+
+/** Drop the reference of a cancelled list operation */
+static void
+find_loopback_data_cancel (struct find_loopback_data *data)
+{
+  data->cancelled = TRUE;
+  find_loopback_data_release (data);
+}
+
+
+/**************** Find loopback lists ****************/
+
+/** Each list operation holds a reference on the find_loopback_data;
+    the join happens when the last of them completes */
+#define FIND_LOOPBACK_LIST_CB(object_type, table)                       \
+  static void                                                           \
+  find_loopback_##object_type##_list_cb                                 \
+  (pa_context *ctx,                                                     \
+   const pa_##object_type##_info *info,                                 \
+   int eol,                                                             \
+   void *userdata)                                                      \
+  {                                                                     \
+    struct find_loopback_data *loopback_data = userdata;                \
+    struct cache_object *object;                                        \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        TRACE_OP_END ("get_" #object_type "_info_list", loopback_data); \
+      }                                                                 \
+                                                                        \
+    if (eol == -1)                                                      \
+      {                                                                 \
+        g_warning ("Error listing PulseAudio " #object_type "s: %s",    \
+                   pa_strerror (pa_context_errno (ctx)));               \
+        find_loopback_data_release (loopback_data);                     \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        wys_flight_record (&FLIGHT_LIST_END, #object_type, NULL,        \
+                           0, 0, 0, NULL);                              \
+        find_loopback_data_release (loopback_data);                     \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    object = cache_object_new_##object_type (info);                     \
+    g_hash_table_replace (loopback_data->table,                         \
+                          GUINT_TO_POINTER (object->index),             \
+                          object);                                      \
+  }
+
+
+FIND_LOOPBACK_LIST_CB(module,        module_objects);
+FIND_LOOPBACK_LIST_CB(source,        devices);
+FIND_LOOPBACK_LIST_CB(sink,          devices);
+FIND_LOOPBACK_LIST_CB(source_output, streams);
+FIND_LOOPBACK_LIST_CB(sink_input,    streams);
+
+
+/** Find any loopback module for the specified source or sink
+    alsa card.
+
+    If the object cache is synchronised, the callback is called
+    immediately with the result from the cache.  Otherwise, we request
+    the module, source / sink and source output / sink input lists all
+    at once and join them in join_loopback() when the last one
+    arrives.  The lists are the loopback's discovery; if it is
+    cancelled, the callback is not called and destroy is called on
+    userdata instead.
+*/
+static void
+find_loopback (WysAudio *self,
+               const gchar *alsa_card,
+               WysDirection direction,
+               GCallback callback,
+               gpointer userdata,
+               GDestroyNotify destroy)
+{
+  struct find_loopback_data *data;
+  pa_operation *op;
+
+  data = find_loopback_data_new (self, alsa_card, direction);
+  data->callback = callback;
+  data->userdata = userdata;
+  data->destroy = destroy;
+
+  if (self->cache_synced)
+    {
+      data->modules = cache_find_loopback (self, alsa_card, direction);
+      find_loopback_data_release (data);
+      return;
+    }
+
+  data->streams = object_table_new ();
+  data->devices = object_table_new ();
+  data->module_objects = object_table_new ();
+
+  loopback_discovery_begin (self, direction, data,
+                            (GDestroyNotify)find_loopback_data_cancel);
+
+#define list(object_type, func)                                         \
+  g_rc_box_acquire (data);                                              \
+  TRACE_OP_BEGIN ("get_" #func, data);                                  \
+  op = pa_context_get_##func                                            \
+    (self->ctx, find_loopback_##object_type##_list_cb, data);           \
+  loopback_discovery_add (self, direction, op);                         \
+  pa_operation_unref (op);
+
+  list (module, module_info_list);
+
+  switch (direction)
+    {
+    case WYS_DIRECTION_FROM_NETWORK:
+      wys_flight_record (&FLIGHT_FIND_LOOPBACK,
+                         wys_direction_get_description (direction), NULL,
+                         0, 0, 0, alsa_card);
+      list (source,        source_info_list);
+      list (source_output, source_output_info_list);
+      break;
+    case WYS_DIRECTION_TO_NETWORK:
+      wys_flight_record (&FLIGHT_FIND_LOOPBACK,
+                         wys_direction_get_description (direction), NULL,
+                         0, 0, 0, alsa_card);
+      list (sink,       sink_info_list);
+      list (sink_input, sink_input_info_list);
+      break;
+    default:
+      break;
+    }
+
+#undef list
+
+  /* Drop our own reference; the last list callback will do the join */
+  find_loopback_data_release (data);
+}
+
+
+/**************** Find ALSA card data ****************/
+
+typedef void (*FindALSACardCallback) (const gchar *alsa_card_name,
+                                      const gchar *pulse_object_name,
+                                      const pa_sample_spec *sample_spec,
+                                      gpointer userdata);
+
+struct find_alsa_card_data
+{
+  WysAudio *self;
+  /** The direction of the loopback the discovery is for */
+  WysDirection direction;
+  gchar *alsa_card_name;
+  GCallback callback;
+  gpointer userdata;
+  /** Frees the userdata instead of calling the callback if the
+      discovery is cancelled */
+  GDestroyNotify destroy;
+  gboolean cancelled;
+  gchar *pulse_object_name;
+  /** The native sample spec of the source or sink we found */
+  pa_sample_spec sample_spec;
+};
+
+
+static struct find_alsa_card_data *
+find_alsa_card_data_new (WysAudio *self,
+                         const gchar *alsa_card_name,
+                         WysDirection direction)
+{
+  struct find_alsa_card_data *data;
+
+  data = g_rc_box_new0 (struct find_alsa_card_data);
+  data->self = self;
+  data->direction = direction;
+  data->alsa_card_name = g_strdup (alsa_card_name);
+
+  WYS_PROBE1 (find_alsa_card_start, data->alsa_card_name);
+
+  return data;
+}
+
+
+static void
+find_alsa_card_data_clear (struct find_alsa_card_data *data)
+{
+  FindALSACardCallback func = (FindALSACardCallback)data->callback;
+
+  loopback_discovery_end (data->self, data->direction, data);
+
+  WYS_PROBE2 (find_alsa_card_done, data->alsa_card_name,
+              data->pulse_object_name);
+
+  if (!data->cancelled)
+    {
+      func (data->alsa_card_name,
+            data->pulse_object_name,
+            data->pulse_object_name ? &data->sample_spec : NULL,
+            data->userdata);
+    }
+  else if (data->destroy)
+    {
+      data->destroy (data->userdata);
+    }
+
+  g_free (data->pulse_object_name);
+  g_free (data->alsa_card_name);
+}
+
+
+static inline void
+find_alsa_card_data_release (struct find_alsa_card_data *data)
+{
+  g_rc_box_release_full (data, (GDestroyNotify)find_alsa_card_data_clear);
+}
+
+
+/** Drop the reference of a cancelled list operation */
+static void
+find_alsa_card_data_cancel (struct find_alsa_card_data *data)
+{
+  data->cancelled = TRUE;
+  find_alsa_card_data_release (data);
+}
+
+
+/**************** Find ALSA card ****************/
+
+/** Find the source or sink for an ALSA card in the object cache.  If
+    there are several, we take the lowest index so that the result
+    doesn't depend on hash table order. */
+static struct cache_object *
+cache_find_alsa_card (WysAudio        *self,
+                      enum cache_kind  kind,
+                      const gchar     *alsa_card_name)
+{
+  GHashTableIter iter;
+  struct cache_object *object, *found = NULL;
+
+  g_hash_table_iter_init (&iter, self->cache[kind]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&object))
+    {
+      if (props_name_alsa_card (object->proplist, alsa_card_name)
+          && (!found || object->index < found->index))
+        {
+          found = object;
+        }
+    }
+
+  if (found)
+    {
+      wys_flight_record (&FLIGHT_CARD_MATCH, CACHE_KIND_NAMES[kind], NULL,
+                         found->index, 0, 0, found->name);
+    }
+
+  return found;
+}
+
+
+#define FIND_ALSA_CARD_LIST_CB(object_type)                             \
+  static void                                                           \
+  find_alsa_card_##object_type##list_cb                                 \
+  (pa_context *ctx,                                                     \
+   const pa_##object_type##_info *info,                                 \
+   int eol,                                                             \
+   void *userdata)                                                      \
+  {                                                                     \
+    struct find_alsa_card_data *alsa_card_data = userdata;              \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        TRACE_OP_END ("get_" #object_type "_info_list",                 \
+                      alsa_card_data);                                  \
+      }                                                                 \
+                                                                        \
+    if (eol == -1)                                                      \
+      {                                                                 \
+        g_warning ("Error listing PulseAudio " #object_type "s: %s",    \
+                   pa_strerror (pa_context_errno (ctx)));               \
+        find_alsa_card_data_release (alsa_card_data);                   \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (eol)                                                            \
+      {                                                                 \
+        wys_flight_record (&FLIGHT_LIST_END, #object_type, NULL,        \
+                           0, 0, 0, NULL);                              \
+        find_alsa_card_data_release (alsa_card_data);                   \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    if (alsa_card_data->pulse_object_name != NULL)                      \
+      {                                                                 \
+        /* Already found our object */                                  \
+        wys_flight_record (&FLIGHT_CARD_SKIP, #object_type, NULL,       \
+                           info->index, 0, 0, info->name);              \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    g_assert (info != NULL);                                            \
+                                                                        \
+    if (!props_name_alsa_card (info->proplist,                          \
+                               alsa_card_data->alsa_card_name))         \
+      {                                                                 \
+        wys_flight_record (&FLIGHT_CARD_MISMATCH, #object_type, NULL,   \
+                           info->index, 0, 0, info->name);              \
+        return;                                                         \
+      }                                                                 \
+                                                                        \
+    wys_flight_record (&FLIGHT_CARD_MATCH, #object_type, NULL,          \
+                       info->index, 0, 0, info->name);                  \
+    alsa_card_data->pulse_object_name = g_strdup (info->name);          \
+    alsa_card_data->sample_spec = info->sample_spec;                    \
+  }
+
+
+#define FIND_ALSA_CARD(object_type, KIND)                       \
+  static void                                                   \
+  find_alsa_card_##object_type (WysAudio *self,                 \
+                                const gchar *alsa_card_name,    \
+                                WysDirection direction,         \
+                                GCallback callback,             \
+                                gpointer userdata,              \
+                                GDestroyNotify destroy)         \
+  {                                                             \
+    pa_operation *op;                                           \
+    struct find_alsa_card_data *data;                           \
+    struct cache_object *object;                                \
+                                                                \
+    data = find_alsa_card_data_new (self, alsa_card_name,       \
+                                    direction);                 \
+    data->callback = callback;                                  \
+    data->userdata = userdata;                                  \
+    data->destroy = destroy;                                    \
+                                                                \
+    if (self->cache_synced)                                     \
+      {                                                         \
+        object = cache_find_alsa_card (self, KIND,              \
+                                       alsa_card_name);         \
+        if (object)                                             \
+          {                                                     \
+            data->pulse_object_name = g_strdup (object->name);  \
+            data->sample_spec = object->sample_spec;            \
+          }                                                     \
+        find_alsa_card_data_release (data);                     \
+        return;                                                 \
+      }                                                         \
+                                                                \
+    loopback_discovery_begin                                    \
+      (self, direction, data,                                   \
+       (GDestroyNotify)find_alsa_card_data_cancel);             \
+                                                                \
+    TRACE_OP_BEGIN ("get_" #object_type "_info_list", data);    \
+    op = pa_context_get_##object_type##_info_list               \
+      (self->ctx, find_alsa_card_##object_type##list_cb, data); \
+                                                                \
+    loopback_discovery_add (self, direction, op);               \
+    pa_operation_unref (op);                                    \
+  }
+
+#define DECLARE_FIND_ALSA_CARD(object_type, KIND)       \
+  FIND_ALSA_CARD_LIST_CB(object_type)                   \
+  FIND_ALSA_CARD(object_type, KIND)
+
+
+DECLARE_FIND_ALSA_CARD(source, CACHE_SOURCE);
+DECLARE_FIND_ALSA_CARD(sink,   CACHE_SINK);
+
+
+/**************** Instantiate loopback data ****************/
+
+typedef void (*InstantiateLoopbackCallback) (gchar *alsa_card,
+                                             WysDirection direction,
+                                             gchar *master,
+                                             gpointer userdata);
+
+
+struct instantiate_loopback_data
+{
+  WysAudio *self;
+  gchar *alsa_card;
+  WysDirection direction;
+  gchar *media_name;
+  gchar *master;
+  /** The native sample spec of the master */
+  pa_sample_spec sample_spec;
+  /** For a standby loopback loaded while no call wants it, the
+      module-stream-restore IDs under which its sink input and source
+      output start muted, or NULL */
+  gchar *restore_ids[2];
+};
+
+
+static struct instantiate_loopback_data *
+instantiate_loopback_data_new (WysAudio *self,
+                               const gchar *alsa_card,
+                               WysDirection direction,
+                               const gchar *media_name)
+{
+  struct instantiate_loopback_data *data;
+
+  data = g_rc_box_new0 (struct instantiate_loopback_data);
+
+  data->self = g_object_ref (self);
+
+  data->alsa_card = g_strdup (alsa_card);
+  data->direction = direction;
+  data->media_name = g_strdup (media_name);
+
+  return data;
+}
+
+
+static void
+instantiate_loopback_data_clear (struct instantiate_loopback_data *data)
+{
+  g_free (data->restore_ids[0]);
+  g_free (data->restore_ids[1]);
+  g_free (data->master);
+  g_free (data->media_name);
+  g_free (data->alsa_card);
+  g_object_unref (data->self);
+}
+
+
+static inline void
+instantiate_loopback_data_release (struct instantiate_loopback_data *data)
+{
+  g_rc_box_release_full (data, (GDestroyNotify)instantiate_loopback_data_clear);
+}
+
+
+/**************** Loopback state ****************/
+
+static const gchar * const LOOPBACK_STATE_NAMES[] =
+  {
+   [LOOPBACK_IDLE]      = "idle",
+   [LOOPBACK_LOADING]   = "loading",
+   [LOOPBACK_ACTIVE]    = "active",
+   [LOOPBACK_UNLOADING] = "unloading"
+  };
+
+
+static void
+loopback_set_state (WysAudio            *self,
+                    WysDirection         direction,
+                    enum loopback_state  state)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+
+  if (state != loopback->state)
+    {
+      /* Whatever a discovery in progress was for no longer holds */
+      loopback_discovery_cancel (self, direction);
+    }
+
+  wys_flight_record (&FLIGHT_LOOPBACK_STATE,
+                     wys_direction_get_description (direction),
+                     LOOPBACK_STATE_NAMES[state], 0, 0, 0,
+                     LOOPBACK_STATE_NAMES[loopback->state]);
+
+  loopback->state = state;
+  latency_update (self, direction);
+}
+
+
+static inline gboolean
+loopback_wanted (WysAudio     *self,
+                 WysDirection  direction)
+{
+  return !self->released
+    && (self->audio[direction] || self->standby);
+}
+
+
+static inline void
+loopback_clear_op (struct loopback *loopback)
+{
+  if (loopback->op)
+    {
+      pa_operation_unref (loopback->op);
+      loopback->op = NULL;
+    }
+}
+
+
+/** Called when a module has been found or loaded for the
+    loopback */
+static void
+loopback_active (WysAudio     *self,
+                 WysDirection  direction,
+                 uint32_t      module_index)
+{
+  self->loopbacks[direction].module = module_index;
+  loopback_set_state (self, direction, LOOPBACK_ACTIVE);
+  loopback_update (self, direction);
+}
+
+
+/** Called when the loopback has been unloaded, or when loading or
+    unloading it failed */
+static void
+loopback_idle (WysAudio     *self,
+               WysDirection  direction)
+{
+  self->loopbacks[direction].module = PA_INVALID_INDEX;
+  g_clear_pointer (&self->loopbacks[direction].alsa_card, g_free);
+  loopback_set_state (self, direction, LOOPBACK_IDLE);
+  span_abandon (self, direction);
+}
+
+
+/** Called when the context has gone away, cancelling any operation
+    in progress.  Whatever module we had is found again by discovery
+    once we're reconnected. */
+static void
+loopback_reset (WysAudio     *self,
+                WysDirection  direction)
+{
+  loopback_clear_op (&self->loopbacks[direction]);
+  loopback_discovery_cancel (self, direction);
+  loopback_idle (self, direction);
+}
+
+
+static void
+loopback_module_removed (WysAudio *self,
+                         uint32_t  index)
+{
+  WysDirection direction;
+  struct loopback *loopback;
+
+  for (direction = WYS_DIRECTION_FROM_NETWORK;
+       direction <= WYS_DIRECTION_TO_NETWORK;
+       ++direction)
+    {
+      loopback = &self->loopbacks[direction];
+
+      /* While unloading, this is our own doing and the unload
+         callback will follow */
+      if (loopback->state != LOOPBACK_ACTIVE
+          || loopback->module != index)
+        {
+          continue;
+        }
+
+      g_warning ("Loopback module %" PRIu32 " %s was unloaded"
+                 " by someone else",
+                 index, wys_direction_get_description (direction));
+
+      loopback_idle (self, direction);
+      loopback_update (self, direction);
+    }
+}
+
+
+/**************** Standby stream entries ****************/
+
+static const gchar * const STANDBY_RESTORE_STREAMS[2] =
+  { "sink-input", "source-output" };
+
+
+/** The module-stream-restore ID under which a standby loopback's
+    sink input or source output starts muted */
+static gchar *
+standby_restore_id (const gchar  *alsa_card,
+                    WysDirection  direction,
+                    guint         stream)
+{
+  return g_strdup_printf ("wys-standby-%s-%s-%s", alsa_card,
+                          direction == WYS_DIRECTION_FROM_NETWORK
+                          ? "from-network" : "to-network",
+                          STANDBY_RESTORE_STREAMS[stream]);
+}
+
+
+/** Log a failed module-stream-restore request.  That
+    module-stream-restore isn't loaded is no surprise; the streams
+    are muted once they appear instead. */
+static void
+standby_restore_error (pa_context  *ctx,
+                       const gchar *what)
+{
+  if (pa_context_errno (ctx) == PA_ERR_NOEXTENSION)
+    {
+      g_debug ("Not %s standby loopback stream entries:"
+               " module-stream-restore is not loaded", what);
+    }
+  else
+    {
+      g_warning ("Error %s standby loopback stream entries: %s",
+                 what, pa_strerror (pa_context_errno (ctx)));
+    }
+}
+
+
+static void
+standby_restore_delete_cb (pa_context *ctx,
+                           int         success,
+                           void       *userdata)
+{
+  if (!success)
+    {
+      standby_restore_error (ctx, "deleting");
+    }
+}
+
+
+/** Delete the entries that start a standby loopback's streams muted.
+    They have done their job once the streams exist.
+    module-stream-restore saves them again whenever standby_apply()
+    mutes or unmutes the streams, so this is done again once the
+    loopback has been unloaded. */
+static void
+standby_restore_delete (WysAudio     *self,
+                        const gchar  *alsa_card,
+                        WysDirection  direction)
+{
+  gchar *ids[3] = { NULL, NULL, NULL };
+  pa_operation *op;
+  guint i;
+
+  for (i = 0; i < 2; ++i)
+    {
+      ids[i] = standby_restore_id (alsa_card, direction, i);
+    }
+
+  g_debug ("Deleting standby loopback stream entries `%s' and `%s'",
+           ids[0], ids[1]);
+
+  op = pa_ext_stream_restore_delete (self->ctx,
+                                     (const char * const *)ids,
+                                     standby_restore_delete_cb,
+                                     NULL);
+  if (op)
+    {
+      pa_operation_unref (op);
+    }
+  else
+    {
+      standby_restore_error (self->ctx, "deleting");
+    }
+
+  g_free (ids[0]);
+  g_free (ids[1]);
+}
+
+
+/**************** Instantiate loopback ****************/
+
+static void
+instantiate_loopback_load_module_cb (pa_context *ctx,
+                                     uint32_t index,
+                                     void *userdata)
+{
+  struct instantiate_loopback_data *data = userdata;
+
+  TRACE_OP_END ("load_module", data);
+  WYS_PROBE2 (load_module_done, data->direction, index);
+  loopback_clear_op (&data->self->loopbacks[data->direction]);
+
+  if (index == PA_INVALID_INDEX)
+    {
+      g_warning ("Error instantiating loopback module with %s `%s'"
+                 " (ALSA card `%s'): %s",
+                 data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
+                 data->master,
+                 data->alsa_card,
+                 pa_strerror (pa_context_errno (ctx)));
+      wys_flight_log ();
+      loopback_idle (data->self, data->direction);
+    }
+  else
+    {
+      g_debug ("Instantiated loopback module %" PRIu32
+               " with %s `%s' (ALSA card `%s')",
+               index,
+               data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
+               data->master,
+               data->alsa_card);
+
+      if (data->restore_ids[0])
+        {
+          /* The streams have started muted */
+          standby_restore_delete (data->self, data->alsa_card,
+                                  data->direction);
+        }
+
+      loopback_active (data->self, data->direction, index);
+      span_stage (data->self, data->direction, SPAN_STREAM);
+      span_streams_check (data->self, data->direction);
+    }
+
+  instantiate_loopback_data_release (data);
+}
+
+
+/** Module arguments to run the loopback streams at the modem's own
+    sample spec, so that audio to or from the modem isn't resampled
+    or remixed on its way through the loopback.  The profile may
+    override any part of the spec. */
+static gchar *
+loopback_spec_args (WysAudio             *self,
+                    const pa_sample_spec *native)
+{
+  GString *args = g_string_new (NULL);
+  pa_sample_spec spec = *native;
+
+  if (self->sample_format != PA_SAMPLE_INVALID)
+    {
+      spec.format = self->sample_format;
+    }
+  if (self->sample_rate != 0)
+    {
+      spec.rate = self->sample_rate;
+    }
+  if (self->channels != 0)
+    {
+      spec.channels = self->channels;
+    }
+
+  if (pa_sample_spec_valid (&spec))
+    {
+      g_string_append_printf (args,
+                              " format=%s rate=%" PRIu32
+                              " channels=%u",
+                              pa_sample_format_to_string (spec.format),
+                              spec.rate,
+                              (guint)spec.channels);
+    }
+
+  if (self->resample_method)
+    {
+      g_string_append_printf (args, " resample_method=%s",
+                              self->resample_method);
+    }
+
+  return g_string_free (args, FALSE);
+}
+
+
+/** Module arguments for the loopback latency.  With adaptive latency,
+    the loopback aims for our current target but may run as high as
+    the maximum while it rides out underruns; that overshoot is what
+    we watch for. */
+static gchar *
+loopback_latency_args (WysAudio     *self,
+                       WysDirection  direction)
+{
+  GString *args = g_string_new (NULL);
+
+  if (self->adaptive)
+    {
+      g_string_append_printf (args,
+                              " latency_msec=%u max_latency_msec=%u",
+                              self->latency[direction].target,
+                              self->latency_max);
+    }
+  else if (self->target_latency != 0)
+    {
+      g_string_append_printf (args, " latency_msec=%u",
+                              self->target_latency);
+    }
+  else
+    {
+      g_string_append (args, " max_latency_msec=25");
+    }
+
+  g_string_append_printf (args, " fast_adjust_threshold_msec=%u",
+                          self->adjust_threshold != 0
+                          ? self->adjust_threshold : 100);
+
+  if (self->adjust_time != 0)
+    {
+      g_string_append_printf (args, " adjust_time=%u",
+                              self->adjust_time);
+    }
+
+  return g_string_free (args, FALSE);
+}
+
+
+/** With our own echo canceller, the phone end of each loopback is
+    attached to it directly rather than through filter-apply.  While
+    it fails to load, the loopbacks fall back to filter-apply. */
+static const gchar *
+loopback_echo_cancel_arg (WysAudio     *self,
+                          WysDirection  direction)
+{
+  if (!echo_cancel_attached (self))
+    {
+      return "";
+    }
+
+  return direction == WYS_DIRECTION_FROM_NETWORK
+    ? " sink=" ECHO_CANCEL_SINK
+    : " source=" ECHO_CANCEL_SOURCE;
+}
+
+
+static void
+instantiate_loopback_load_module (struct instantiate_loopback_data *data)
+{
+  pa_proplist *stream_props;
+  gchar *stream_sink_props_str, *stream_source_props_str;
+  gchar *spec_args, *latency_args;
+  gchar *arg;
+  pa_operation *op;
+
+  g_debug ("Instantiating loopback module with %s `%s'"
+           " (ALSA card `%s')",
+           data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
+           data->master,
+           data->alsa_card);
+
+  // sink properties
+  stream_props = pa_proplist_new ();
+  g_assert (stream_props != NULL);
+  proplist_set (stream_props, "media.role", "phone");
+  proplist_set (stream_props, "media.icon_name", "phone");
+  proplist_set (stream_props, "media.name", data->media_name);
+  if (data->direction == WYS_DIRECTION_FROM_NETWORK
+      && !echo_cancel_attached (data->self))
+    {
+      proplist_set (stream_props, "filter.want", "echo-cancel");
+    }
+  if (data->restore_ids[0])
+    {
+      proplist_set (stream_props, "module-stream-restore.id",
+                    data->restore_ids[0]);
+    }
+
+  stream_sink_props_str = pa_proplist_to_string (stream_props);
+  pa_proplist_free (stream_props);
+
+  // source properties
+  stream_props = pa_proplist_new ();
+  g_assert (stream_props != NULL);
+  proplist_set (stream_props, "media.role", "phone");
+  proplist_set (stream_props, "media.icon_name", "phone");
+  proplist_set (stream_props, "media.name", data->media_name);
+  if (data->direction == WYS_DIRECTION_TO_NETWORK
+      && !echo_cancel_attached (data->self))
+    {
+      proplist_set (stream_props, "filter.want", "echo-cancel");
+    }
+  if (data->restore_ids[1])
+    {
+      proplist_set (stream_props, "module-stream-restore.id",
+                    data->restore_ids[1]);
+    }
+
+  stream_source_props_str = pa_proplist_to_string (stream_props);
+  pa_proplist_free (stream_props);
+
+  spec_args = loopback_spec_args (data->self, &data->sample_spec);
+  latency_args = loopback_latency_args (data->self, data->direction);
+
+  arg = g_strdup_printf ("%s=%s"
+                         " %s_dont_move=true"
+                         "%s%s%s"
+                         " sink_input_properties='%s'"
+                         " source_output_properties='%s'",
+                         data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
+                         data->master,
+                         data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
+                         loopback_echo_cancel_arg (data->self, data->direction),
+                         latency_args,
+                         spec_args,
+                         stream_sink_props_str,
+                         stream_source_props_str);
+  pa_xfree (stream_sink_props_str);
+  pa_xfree (stream_source_props_str);
+  g_free (latency_args);
+  g_free (spec_args);
+
+  TRACE_OP_BEGIN ("load_module", data);
+  WYS_PROBE1 (load_module_issued, data->direction);
+  op = pa_context_load_module (data->self->ctx,
+                               "module-loopback",
+                               arg,
+                               instantiate_loopback_load_module_cb,
+                               data);
+  if (op)
+    {
+      data->self->loopbacks[data->direction].op = op;
+    }
+  else
+    {
+      g_warning ("Error loading loopback module: %s",
+                 pa_strerror (pa_context_errno (data->self->ctx)));
+      loopback_idle (data->self, data->direction);
+      instantiate_loopback_data_release (data);
+    }
+
+  g_free (arg);
+}
+
+
+static void
+instantiate_loopback_restore_cb (pa_context *ctx,
+                                 int         success,
+                                 void       *userdata)
+{
+  struct instantiate_loopback_data *data = userdata;
+
+  TRACE_OP_END ("stream_restore_write", data);
+  loopback_clear_op (&data->self->loopbacks[data->direction]);
+
+  if (!success)
+    {
+      standby_restore_error (ctx, "writing");
+      g_clear_pointer (&data->restore_ids[0], g_free);
+      g_clear_pointer (&data->restore_ids[1], g_free);
+    }
+
+  instantiate_loopback_load_module (data);
+}
+
+
+/** Load a standby loopback that no call wants yet with its streams
+    muted from the start, so that no modem audio gets through before
+    standby_apply() sees the streams.  module-loopback takes no mute
+    or volume arguments, so the streams are given
+    module-stream-restore IDs and muted entries are written for those
+    IDs first; module-stream-restore applies them as the streams are
+    created, and they are deleted again once the module is loaded. */
+static void
+instantiate_loopback_start_muted (struct instantiate_loopback_data *data)
+{
+  pa_ext_stream_restore_info info[2];
+  pa_operation *op;
+  guint i;
+
+  for (i = 0; i < 2; ++i)
+    {
+      data->restore_ids[i] = standby_restore_id (data->alsa_card,
+                                                 data->direction, i);
+
+      memset (&info[i], 0, sizeof (info[i]));
+      info[i].name = data->restore_ids[i];
+      pa_channel_map_init (&info[i].channel_map);
+      pa_cvolume_init (&info[i].volume);
+      info[i].device = NULL;
+      info[i].mute = TRUE;
+    }
+
+  op = pa_ext_stream_restore_write (data->self->ctx, PA_UPDATE_REPLACE,
+                                    info, 2, FALSE,
+                                    instantiate_loopback_restore_cb,
+                                    data);
+  if (!op)
+    {
+      standby_restore_error (data->self->ctx, "writing");
+      g_clear_pointer (&data->restore_ids[0], g_free);
+      g_clear_pointer (&data->restore_ids[1], g_free);
+      instantiate_loopback_load_module (data);
+      return;
+    }
+
+  TRACE_OP_BEGIN ("stream_restore_write", data);
+  data->self->loopbacks[data->direction].op = op;
+}
+
+
+static void
+instantiate_loopback_master_cb (const gchar          *alsa_card_name,
+                                const gchar          *pulse_object_name,
+                                const pa_sample_spec *sample_spec,
+                                gpointer              userdata)
+{
+  struct instantiate_loopback_data *data = userdata;
+
+  if (!pulse_object_name)
+    {
+      g_warning ("Could not find source/sink for ALSA card `%s'",
+                 alsa_card_name);
+      loopback_idle (data->self, data->direction);
+      instantiate_loopback_data_release (data);
+      return;
+    }
+
+  if (!loopback_wanted (data->self, data->direction))
+    {
+      /* Audio went away while we were looking */
+      g_debug ("Loopback %s no longer wanted, not loading",
+               wys_direction_get_description (data->direction));
+      loopback_idle (data->self, data->direction);
+      instantiate_loopback_data_release (data);
+      return;
+    }
+
+  data->master = g_strdup (pulse_object_name);
+  data->sample_spec = *sample_spec;
+
+  span_stage (data->self, data->direction, SPAN_LOAD);
+
+  if (data->self->standby && !data->self->audio[data->direction])
+    {
+      instantiate_loopback_start_muted (data);
+    }
+  else
+    {
+      instantiate_loopback_load_module (data);
+    }
+}
+
+
+static void
+instantiate_loopback (WysAudio *self,
+                      const gchar *alsa_card,
+                      WysDirection direction,
+                      const gchar *media_name)
+{
+  struct instantiate_loopback_data *loopback_data;
+
+  loopback_data = instantiate_loopback_data_new (self,
+                                                 alsa_card,
+                                                 direction,
+                                                 media_name);
+
+  switch (direction)
+    {
+    case WYS_DIRECTION_FROM_NETWORK:
+      wys_flight_record (&FLIGHT_FIND_CARD, "source", NULL,
+                         0, 0, 0, alsa_card);
+      find_alsa_card_source (self,
+                             alsa_card,
+                             direction,
+                             G_CALLBACK (instantiate_loopback_master_cb),
+                             loopback_data,
+                             (GDestroyNotify)instantiate_loopback_data_release);
+      break;
+    case WYS_DIRECTION_TO_NETWORK:
+      wys_flight_record (&FLIGHT_FIND_CARD, "sink", NULL,
+                         0, 0, 0, alsa_card);
+      find_alsa_card_sink (self,
+                           alsa_card,
+                           direction,
+                           G_CALLBACK (instantiate_loopback_master_cb),
+                           loopback_data,
+                           (GDestroyNotify)instantiate_loopback_data_release);
+      break;
+    default:
+      break;
+    }
+}
+
+
+/**************** Ensure loopback ****************/
+
+struct ensure_loopback_data
+{
+  WysAudio *self;
+  const gchar *media_name;
+};
+
+
+static void
+ensure_loopback_find_loopback_cb (gchar *alsa_card,
+                                  WysDirection direction,
+                                  GList *modules,
+                                  struct ensure_loopback_data *data)
+{
+  if (modules != NULL)
+    {
+      g_warning ("%u loopback module(s) for ALSA card `%s' %s ->"
+                 " already exist",
+                 g_list_length (modules),
+                 alsa_card,
+                 direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
+
+      /* Take over the first existing module so that we can unload
+         it directly later, and unload the others; nothing would
+         ever unload them otherwise */
+      g_list_foreach (modules->next,
+                      (GFunc)ensure_no_loopback_modules_cb,
+                      data->self->ctx);
+
+      span_end (data->self, direction, FALSE);
+      loopback_active (data->self, direction,
+                       GPOINTER_TO_UINT (modules->data));
+    }
+  else if (!loopback_wanted (data->self, direction))
+    {
+      g_debug ("Loopback %s no longer wanted, not instantiating",
+               wys_direction_get_description (direction));
+      loopback_idle (data->self, direction);
+    }
+  else
+    {
+      g_debug ("Instantiating loopback module for ALSA card `%s' %s",
+               alsa_card,
+               direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
+
+      span_stage (data->self, direction, SPAN_DEVICE);
+      instantiate_loopback (data->self, alsa_card,
+                            direction, data->media_name);
+    }
+
+  g_free (data);
+}
+
+
+static void
+ensure_loopback (WysAudio *self,
+                 const gchar *alsa_card,
+                 WysDirection  direction,
+                 const gchar *media_name)
+{
+  struct ensure_loopback_data *data;
+
+  data = g_new (struct ensure_loopback_data, 1);
+  data->self = self;
+  // This is a static string so we don't need a copy
+  data->media_name = media_name;
+  find_loopback (self, alsa_card, direction,
+                 G_CALLBACK (ensure_loopback_find_loopback_cb),
+                 data, g_free);
+}
+
+
+static const gchar *
+loopback_media_name (WysDirection direction)
+{
+  switch (direction)
+    {
+    case WYS_DIRECTION_FROM_NETWORK:
+      return "Voice call audio (to speaker)";
+    case WYS_DIRECTION_TO_NETWORK:
+      return "Voice call audio (from mic)";
+    default:
+      return NULL;
+    }
+}
+
+
+/**************** Ensure no loopback ****************/
+
+static void
+ensure_no_loopback_unload_module_cb (pa_context *ctx,
+                                     int success,
+                                     void *userdata)
+{
+  const guint module_index = GPOINTER_TO_UINT (userdata);
+
+  TRACE_OP_END ("unload_module", userdata);
+  WYS_PROBE2 (unload_module_done, module_index, success);
+  if (success)
+    {
+      g_debug ("Successfully deinstantiated loopback module %u",
+               module_index);
+    }
+  else
+    {
+      g_warning ("Error deinstantiating loopback module %u: %s",
+                 module_index,
+                 pa_strerror (pa_context_errno (ctx)));
+    }
+}
+
+
+static void
+ensure_no_loopback_modules_cb (gpointer data,
+                               pa_context *ctx)
+{
+  const uint32_t module_index = GPOINTER_TO_UINT (data);
+  pa_operation *op;
+
+  g_debug ("Deinstantiating loopback module %" PRIu32,
+           module_index);
+
+  TRACE_OP_BEGIN ("unload_module", data);
+  WYS_PROBE1 (unload_module_issued, module_index);
+  op = pa_context_unload_module (ctx,
+                                 module_index,
+                                 ensure_no_loopback_unload_module_cb,
+                                 data);
+
+  pa_operation_unref (op);
+}
+
+
+static void
+ensure_no_loopback_find_loopback_cb (gchar *alsa_card,
+                                     WysDirection direction,
+                                     GList *modules,
+                                     pa_context *ctx)
+{
+  if (modules == NULL)
+    {
+      g_warning ("No loopback module(s) for ALSA card `%s' %s",
+                 alsa_card,
+                 direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
+      return;
+    }
+
+  g_debug ("Deinstantiating loopback modules for ALSA card `%s' %s",
+           alsa_card,
+           direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
+
+  g_list_foreach (modules,
+                  (GFunc)ensure_no_loopback_modules_cb,
+                  ctx);
+}
+
+
+static void
+ensure_no_loopback (WysAudio *self,
+                    const gchar *alsa_card,
+                    WysDirection direction)
+{
+  find_loopback (self, alsa_card, direction,
+                 G_CALLBACK (ensure_no_loopback_find_loopback_cb),
+                 self->ctx, NULL);
+}
+
+
+/**************** Unload owned loopback ****************/
+
+struct unload_loopback_data
+{
+  WysAudio *self;
+  WysDirection direction;
+  uint32_t module_index;
+};
+
+
+static void
+unload_loopback_cb (pa_context *ctx,
+                    int success,
+                    void *userdata)
+{
+  struct unload_loopback_data *data = userdata;
+  WysAudio *self = data->self;
+  gboolean stale = FALSE;
+
+  TRACE_OP_END ("unload_module", data);
+  WYS_PROBE2 (unload_module_done, data->module_index, success);
+  loopback_clear_op (&self->loopbacks[data->direction]);
+
+  if (success)
+    {
+      g_debug ("Successfully deinstantiated loopback module %" PRIu32,
+               data->module_index);
+    }
+  else if (pa_context_errno (ctx) == PA_ERR_NOENTITY)
+    {
+      g_debug ("Loopback module %" PRIu32 " no longer exists",
+               data->module_index);
+      stale = TRUE;
+    }
+  else
+    {
+      g_warning ("Error deinstantiating loopback module %" PRIu32 ": %s",
+                 data->module_index,
+                 pa_strerror (pa_context_errno (ctx)));
+    }
+
+  span_end (self, data->direction, TRUE);
+
+  if (self->standby && self->loopbacks[data->direction].alsa_card)
+    {
+      standby_restore_delete (self,
+                              self->loopbacks[data->direction].alsa_card,
+                              data->direction);
+    }
+
+  loopback_idle (self, data->direction);
+
+  if (stale && !loopback_wanted (self, data->direction)
+      && self->ready && self->modem)
+    {
+      /* Our index was stale; look for any loopback the slow way.
+         Without a modem there is no card to look on; the loopback
+         went with it. */
+      g_debug ("Finding loopback modules for ALSA card `%s'",
+               self->modem);
+      ensure_no_loopback (self, self->modem, data->direction);
+    }
+  else
+    {
+      loopback_update (self, data->direction);
+    }
+
+  g_object_unref (self);
+  g_free (data);
+}
+
+
+static void
+unload_loopback (WysAudio     *self,
+                 WysDirection  direction)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+  struct unload_loopback_data *data;
+  pa_operation *op;
+
+  data = g_new (struct unload_loopback_data, 1);
+  data->self = g_object_ref (self);
+  data->direction = direction;
+  data->module_index = loopback->module;
+
+  g_debug ("Deinstantiating owned loopback module %" PRIu32,
+           data->module_index);
+
+  span_stage (self, direction, SPAN_UNLOAD);
+
+  loopback_set_state (self, direction, LOOPBACK_UNLOADING);
+
+  TRACE_OP_BEGIN ("unload_module", data);
+  WYS_PROBE1 (unload_module_issued, data->module_index);
+  op = pa_context_unload_module (self->ctx,
+                                 data->module_index,
+                                 unload_loopback_cb,
+                                 data);
+  if (!op)
+    {
+      g_warning ("Error deinstantiating loopback module %" PRIu32 ": %s",
+                 data->module_index,
+                 pa_strerror (pa_context_errno (self->ctx)));
+      loopback_idle (self, direction);
+      g_object_unref (self);
+      g_free (data);
+      return;
+    }
+
+  loopback->op = op;
+}
+
+
+/**************** Update loopback ****************/
+
+/** Bring the loopback in the specified direction towards the state
+    we want.  While a load or unload is in progress, nothing is done;
+    the operation's callback calls us again when it completes, so any
+    number of requests in the meantime collapse into the final
+    wanted state.  A discovery that is no longer wanted has nothing
+    to wait for, and is cancelled instead. */
+static void
+loopback_update (WysAudio     *self,
+                 WysDirection  direction)
+{
+  struct loopback *loopback = &self->loopbacks[direction];
+  const gboolean wanted = loopback_wanted (self, direction);
+
+  if (self->ready && loopback->state == LOOPBACK_ACTIVE
+      && g_strcmp0 (loopback->alsa_card, self->modem) != 0)
+    {
+      /* The card was handed over to another instance; the
+         loopback on it is no longer ours to keep */
+      unload_loopback (self, direction);
+      return;
+    }
+
+  if (!self->ready || !self->modem)
+    {
+      wys_flight_record (&FLIGHT_LOOPBACK_WAIT,
+                         wys_direction_get_description (direction),
+                         !self->ready ? "pulseaudio" : "modem",
+                         0, 0, 0, NULL);
+      return;
+    }
+
+  if (loopback->state == LOOPBACK_LOADING && !wanted
+      && loopback->discovery_data)
+    {
+      g_debug ("Loopback %s no longer wanted, cancelling discovery",
+               wys_direction_get_description (direction));
+      loopback_idle (self, direction);
+    }
+
+  switch (loopback->state)
+    {
+    case LOOPBACK_IDLE:
+      if (wanted && !echo_cancel_ready (self))
+        {
+          wys_flight_record (&FLIGHT_LOOPBACK_WAIT,
+                             wys_direction_get_description (direction),
+                             "echo-cancel", 0, 0, 0, NULL);
+        }
+      else if (wanted)
+        {
+          span_stage (self, direction, SPAN_DISCOVER);
+          loopback->alsa_card = g_strdup (self->modem);
+          loopback_set_state (self, direction, LOOPBACK_LOADING);
+          ensure_loopback (self, self->modem, direction,
+                           loopback_media_name (direction));
+        }
+      break;
+
+    case LOOPBACK_ACTIVE:
+      if (!wanted)
+        {
+          unload_loopback (self, direction);
+        }
+      else if (self->standby)
+        {
+          standby_apply (self, direction);
+        }
+      break;
+
+    case LOOPBACK_LOADING:
+    case LOOPBACK_UNLOADING:
+      wys_flight_record (&FLIGHT_LOOPBACK_DEFER,
+                         wys_direction_get_description (direction),
+                         LOOPBACK_STATE_NAMES[loopback->state],
+                         0, 0, 0, NULL);
+      break;
+    }
+
+  latency_update (self, direction);
+}
+
+
+static void
+update_loopbacks (WysAudio *self)
+{
+  echo_cancel_update (self);
+  loopback_update (self, WYS_DIRECTION_FROM_NETWORK);
+  loopback_update (self, WYS_DIRECTION_TO_NETWORK);
+}
+
+
+void
+wys_audio_ensure_loopback (WysAudio     *self,
+                           WysDirection  direction)
+{
+  g_return_if_fail (WYS_IS_AUDIO (self));
+
+  if (!self->audio[direction]
+      && self->loopbacks[direction].state != LOOPBACK_ACTIVE)
+    {
+      span_begin (self, direction, FALSE);
+    }
+
+  self->audio[direction] = TRUE;
+  loopback_update (self, direction);
+}
+
+
+void
+wys_audio_ensure_no_loopback (WysAudio     *self,
+                              WysDirection  direction)
+{
+  g_return_if_fail (WYS_IS_AUDIO (self));
+
+  if (self->audio[direction] && !self->standby
+      && self->loopbacks[direction].state == LOOPBACK_ACTIVE)
+    {
+      span_begin (self, direction, TRUE);
+    }
+
+  self->audio[direction] = FALSE;
+
+  if (!self->ready || !self->modem)
+    {
+      return;
+    }
+
+  if (self->loopbacks[direction].state == LOOPBACK_IDLE
+      && !loopback_wanted (self, direction))
+    {
+      /* We have no loopback of our own; clear up any that
+         someone else left behind */
+      ensure_no_loopback (self, self->modem, direction);
+      return;
+    }
+
+  loopback_update (self, direction);
+}
+
+
+/** Unload our loopbacks, standby ones included, and let our echo
+    canceller go before the instance is dropped, so that nothing of
+    ours is left behind in the server.  The unloads hold references
+    of their own, so the connection stays up until they are done. */
+void
+wys_audio_release (WysAudio *self)
+{
+  g_return_if_fail (WYS_IS_AUDIO (self));
+
+  g_debug ("Releasing our loopbacks and echo canceller");
+  self->released = TRUE;
+
+  update_loopbacks (self);
+  echo_cancel_release (self);
+}
+
+
+/**************** Standby ****************/
+
+static void
+standby_mute_cb (pa_context *ctx,
+                 int success,
+                 void *userdata)
+{
+  /* The stream may have gone by now; its address is only an ID */
+  TRACE_OP_END ("set_mute", userdata);
+
+  if (!success)
+    {
+      g_warning ("Error setting standby loopback stream mute: %s",
+                 pa_strerror (pa_context_errno (ctx)));
+    }
+}
+
+
+static void
+standby_mute_streams (WysAudio        *self,
+                      enum cache_kind  kind,
+                      uint32_t         module_index,
+                      gboolean         mute)
+{
+  GHashTableIter iter;
+  struct cache_object *stream;
+  pa_operation *op;
+
+  g_hash_table_iter_init (&iter, self->cache[kind]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&stream))
+    {
+      if (stream->owner_module != module_index
+          || stream->mute == mute)
+        {
+          continue;
+        }
+
+      wys_flight_record (&FLIGHT_STANDBY_MUTE, CACHE_KIND_NAMES[kind], NULL,
+                         stream->index, mute, 0, NULL);
+
+      if (kind == CACHE_SINK_INPUT)
+        {
+          op = pa_context_set_sink_input_mute
+            (self->ctx, stream->index, mute, standby_mute_cb, stream);
+        }
+      else
+        {
+          op = pa_context_set_source_output_mute
+            (self->ctx, stream->index, mute, standby_mute_cb, stream);
+        }
+
+      if (op)
+        {
+          TRACE_OP_BEGIN ("set_mute", stream);
+          pa_operation_unref (op);
+        }
+
+      /* Don't ask again before the change event arrives */
+      stream->mute = mute;
+    }
+}
+
+
+/** Mute or unmute the streams of our loopback module in the
+    specified direction according to whether audio is wanted */
+static void
+standby_apply (WysAudio     *self,
+               WysDirection  direction)
+{
+  const uint32_t module_index = self->loopbacks[direction].module;
+  const gboolean mute = !self->audio[direction];
+
+  if (module_index == PA_INVALID_INDEX)
+    {
+      return;
+    }
+
+  standby_mute_streams (self, CACHE_SINK_INPUT, module_index, mute);
+  standby_mute_streams (self, CACHE_SOURCE_OUTPUT, module_index, mute);
+}
+
+
+/**************** Call telemetry ****************/
+
+static void
+telemetry_init (struct call_telemetry *telemetry)
+{
+  telemetry->buffer = wys_histogram_new ();
+  telemetry->device = wys_histogram_new ();
+  telemetry->total = wys_histogram_new ();
+  telemetry->drift = wys_histogram_new ();
+}
+
+
+static void
+telemetry_clear (struct call_telemetry *telemetry)
+{
+  g_clear_pointer (&telemetry->buffer, wys_histogram_free);
+  g_clear_pointer (&telemetry->device, wys_histogram_free);
+  g_clear_pointer (&telemetry->total, wys_histogram_free);
+  g_clear_pointer (&telemetry->drift, wys_histogram_free);
+}
+
+
+static void
+telemetry_record (WysAudio     *self,
+                  WysDirection  direction,
+                  pa_usec_t     buffer_usec,
+                  pa_usec_t     device_usec,
+                  uint32_t      sink_input_rate,
+                  uint32_t      source_output_rate)
+{
+  struct call_telemetry *telemetry = &self->telemetry[direction];
+  gint64 drift;
+
+  wys_histogram_record (telemetry->buffer,
+                        buffer_usec / PA_USEC_PER_MSEC);
+  wys_histogram_record (telemetry->device,
+                        device_usec / PA_USEC_PER_MSEC);
+  wys_histogram_record (telemetry->total,
+                        (buffer_usec + device_usec) / PA_USEC_PER_MSEC);
+
+  if (source_output_rate != 0)
+    {
+      drift = ((gint64)sink_input_rate - (gint64)source_output_rate)
+        * 1000000 / (gint64)source_output_rate;
+      wys_histogram_record (telemetry->drift, ABS (drift));
+    }
+}
+
+
+/** Log what the loopback did over the call that just ended and start
+    afresh for the next one */
+static void
+telemetry_report (WysAudio     *self,
+                  WysDirection  direction)
+{
+  struct call_telemetry *telemetry = &self->telemetry[direction];
+  const gchar *description = wys_direction_get_description (direction);
+  g_autofree gchar *buffer = NULL, *device = NULL;
+  g_autofree gchar *total = NULL, *drift = NULL;
+
+  if (wys_histogram_get_count (telemetry->total) == 0)
+    {
+      return;
+    }
+
+  buffer = wys_histogram_to_string (telemetry->buffer);
+  device = wys_histogram_to_string (telemetry->device);
+  total = wys_histogram_to_string (telemetry->total);
+  drift = wys_histogram_to_string (telemetry->drift);
+
+  g_message ("Loopback %s latency (ms): %s", description, total);
+  g_message ("Loopback %s buffer latency (ms): %s", description, buffer);
+  g_message ("Loopback %s device latency (ms): %s", description, device);
+  g_message ("Loopback %s rate drift (ppm): %s", description, drift);
+  g_message ("Loopback %s underruns: %u", description,
+             telemetry->underruns);
+
+  wys_histogram_reset (telemetry->buffer);
+  wys_histogram_reset (telemetry->device);
+  wys_histogram_reset (telemetry->total);
+  wys_histogram_reset (telemetry->drift);
+  telemetry->underruns = 0;
+}
+
+
+/**************** Adaptive latency ****************/
+
+/** The measured latency of one of our loopbacks, put together from
+    its sink input and source output */
+struct latency_sample_data
+{
+  WysAudio *self;
+  WysDirection direction;
+  uint32_t module;
+  /** The latency of the streams' buffers and of the sink and
+      source */
+  pa_usec_t buffer_usec;
+  pa_usec_t device_usec;
+  /** The current rate of the sink input, which module-loopback
+      adjusts, and the nominal rate of the source output */
+  uint32_t sink_input_rate;
+  uint32_t source_output_rate;
+  /** Whether either query failed */
+  gboolean failed;
+};
+
+
+static struct latency_sample_data *
+latency_sample_data_new (WysAudio     *self,
+                         WysDirection  direction,
+                         uint32_t      module)
+{
+  struct latency_sample_data *data;
+
+  data = g_rc_box_new0 (struct latency_sample_data);
+  data->self = g_object_ref (self);
+  data->direction = direction;
+  data->module = module;
+
+  return data;
+}
+
+
+static void latency_sample_done (struct latency_sample_data *data);
+
+
+static void
+latency_sample_data_clear (struct latency_sample_data *data)
+{
+  latency_sample_done (data);
+  g_object_unref (data->self);
+}
+
+
+static inline void
+latency_sample_data_release (struct latency_sample_data *data)
+{
+  g_rc_box_release_full (data, (GDestroyNotify)latency_sample_data_clear);
+}
+
+
+/** The loopback has glitched; raise its latency and reload it so
+    that the rest of the call runs at the new target */
+static void
+latency_raise (WysAudio     *self,
+               WysDirection  direction)
+{
+  struct latency_control *control = &self->latency[direction];
+  const guint target =
+    MIN (self->latency_max,
+         control->target + MAX (control->target / 2, 2));
+
+  control->glitched = TRUE;
+
+  if (target == control->target)
+    {
+      g_debug ("Loopback %s latency is already at its maximum of %ums",
+               wys_direction_get_description (direction), target);
+      return;
+    }
+
+  g_message ("Loopback %s can't sustain %ums, reloading at %ums",
+             wys_direction_get_description (direction),
+             control->target, target);
+  control->target = target;
+
+  unload_loopback (self, direction);
+}
+
+
+/** The call has ended.  If the loopback held its target throughout,
+    try a tighter one for the next call. */
+static void
+latency_lower (WysAudio     *self,
+               WysDirection  direction)
+{
+  struct latency_control *control = &self->latency[direction];
+  const guint target =
+    MAX (self->latency_min,
+         control->target - MAX (control->target / 8, 1));
+
+  if (control->glitched
+      || control->samples < LATENCY_STABLE_SAMPLES
+      || target == control->target)
+    {
+      return;
+    }
+
+  g_debug ("Loopback %s held %ums for %u samples, trying %ums next",
+           wys_direction_get_description (direction),
+           control->target, control->samples, target);
+  control->target = target;
+}
+
+
+/** The latency we asked module-loopback for in the specified
+    direction, in milliseconds, or 0 if it runs at its own default */
+static guint
+latency_requested (WysAudio     *self,
+                   WysDirection  direction)
+{
+  if (self->adaptive)
+    {
+      return self->latency[direction].target;
+    }
+
+  return self->target_latency;
+}
+
+
+static void
+latency_sample_done (struct latency_sample_data *data)
+{
+  WysAudio *self = data->self;
+  struct latency_control *control = &self->latency[data->direction];
+  struct loopback *loopback = &self->loopbacks[data->direction];
+  const guint msec =
+    (data->buffer_usec + data->device_usec) / PA_USEC_PER_MSEC;
+  const guint requested = latency_requested (self, data->direction);
+
+  if (data->failed
+      || loopback->state != LOOPBACK_ACTIVE
+      || loopback->module != data->module
+      || control->sample_id == 0)
+    {
+      /* The loopback changed while we were measuring it */
+      return;
+    }
+
+  ++control->samples;
+  telemetry_record (self, data->direction,
+                    data->buffer_usec, data->device_usec,
+                    data->sink_input_rate, data->source_output_rate);
+
+  /* module-loopback absorbs underruns by running at a higher latency
+     than it was asked for, so a loopback that stays well above its
+     target is one that is glitching.  Without a latency of our own,
+     there is no target to go over. */
+  if (requested != 0
+      && msec > requested + MAX (requested / 2, LATENCY_SLACK_MSEC))
+    {
+      if (control->over == 0)
+        {
+          ++self->telemetry[data->direction].underruns;
+        }
+      ++control->over;
+    }
+  else
+    {
+      control->over = 0;
+    }
+
+  wys_flight_record (&FLIGHT_LATENCY,
+                     wys_direction_get_description (data->direction),
+                     NULL, msec, requested, control->over, NULL);
+
+  if (self->adaptive && control->over >= LATENCY_OVER_SAMPLES)
+    {
+      control->over = 0;
+      latency_raise (self, data->direction);
+    }
+}
+
+
+static void
+latency_sink_input_cb (pa_context *ctx,
+                       const pa_sink_input_info *info,
+                       int eol,
+                       void *userdata)
+{
+  struct latency_sample_data *data = userdata;
+
+  if (eol)
+    {
+      TRACE_OP_END ("get_sink_input_info", data);
+      if (eol < 0)
+        {
+          data->failed = TRUE;
+        }
+      latency_sample_data_release (data);
+      return;
+    }
+
+  data->buffer_usec += info->buffer_usec;
+  data->device_usec += info->sink_usec;
+  data->sink_input_rate = info->sample_spec.rate;
+}
+
+
+static void
+latency_source_output_cb (pa_context *ctx,
+                          const pa_source_output_info *info,
+                          int eol,
+                          void *userdata)
+{
+  struct latency_sample_data *data = userdata;
+
+  if (eol)
+    {
+      TRACE_OP_END ("get_source_output_info", data);
+      if (eol < 0)
+        {
+          data->failed = TRUE;
+        }
+      latency_sample_data_release (data);
+      return;
+    }
+
+  data->buffer_usec += info->buffer_usec;
+  data->device_usec += info->source_usec;
+  data->source_output_rate = info->sample_spec.rate;
+}
+
+
+/** Find the stream of the given kind that belongs to our module */
+static struct cache_object *
+latency_find_stream (WysAudio        *self,
+                     enum cache_kind  kind,
+                     uint32_t         module)
+{
+  GHashTableIter iter;
+  struct cache_object *stream;
+
+  g_hash_table_iter_init (&iter, self->cache[kind]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&stream))
+    {
+      if (stream->owner_module == module)
+        {
+          return stream;
+        }
+    }
+
+  return NULL;
+}
+
+
+struct latency_timeout_data
 {
-  g_rc_box_release_full (data, (GDestroyNotify)find_alsa_card_data_clear);
+  WysAudio *self;
+  WysDirection direction;
+};
+
+
+static gboolean
+latency_sample_cb (struct latency_timeout_data *timeout)
+{
+  WysAudio *self = timeout->self;
+  const WysDirection direction = timeout->direction;
+  const uint32_t module = self->loopbacks[direction].module;
+  struct cache_object *sink_input, *source_output;
+  struct latency_sample_data *data;
+  pa_operation *op;
+
+  sink_input = latency_find_stream (self, CACHE_SINK_INPUT, module);
+  source_output = latency_find_stream (self, CACHE_SOURCE_OUTPUT, module);
+  if (!sink_input || !source_output)
+    {
+      return G_SOURCE_CONTINUE;
+    }
+
+  data = latency_sample_data_new (self, direction, module);
+
+  op = pa_context_get_sink_input_info
+    (self->ctx, sink_input->index, latency_sink_input_cb,
+     g_rc_box_acquire (data));
+  if (op)
+    {
+      TRACE_OP_BEGIN ("get_sink_input_info", data);
+      pa_operation_unref (op);
+    }
+  else
+    {
+      data->failed = TRUE;
+      g_rc_box_release (data);
+    }
+
+  op = pa_context_get_source_output_info
+    (self->ctx, source_output->index, latency_source_output_cb,
+     g_rc_box_acquire (data));
+  if (op)
+    {
+      TRACE_OP_BEGIN ("get_source_output_info", data);
+      pa_operation_unref (op);
+    }
+  else
+    {
+      data->failed = TRUE;
+      g_rc_box_release (data);
+    }
+
+  /* Drop our own reference; the last callback judges the sample */
+  latency_sample_data_release (data);
+
+  return G_SOURCE_CONTINUE;
 }
 
 
-/**************** Find ALSA card ****************/
+/** Sample the loopback's latency while it carries call audio and
+    stop when it doesn't, judging and reporting on the call when it
+    ends */
+static void
+latency_update (WysAudio     *self,
+                WysDirection  direction)
+{
+  struct latency_control *control = &self->latency[direction];
+  struct latency_timeout_data *timeout;
+  const gboolean sample =
+    self->audio[direction]
+    && self->loopbacks[direction].state == LOOPBACK_ACTIVE;
 
-#define FIND_ALSA_CARD_LIST_CB(object_type)                             \
-  static void                                                           \
-  find_alsa_card_##object_type##list_cb                                 \
-  (pa_context *ctx,                                                     \
-   const pa_##object_type##_info *info,                                 \
-   int eol,                                                             \
-   void *userdata)                                                      \
-  {                                                                     \
-    struct find_alsa_card_data *alsa_card_data = userdata;              \
-                                                                        \
-    if (eol == -1)                                                      \
-      {                                                                 \
-        wys_error ("Error listing PulseAudio " #object_type "s: %s",    \
-                   pa_strerror (pa_context_errno (ctx)));               \
-      }                                                                 \
-                                                                        \
-    if (eol)                                                            \
-      {                                                                 \
-        g_debug ("End of " #object_type " list reached");               \
-        find_alsa_card_data_release (alsa_card_data);                   \
-        return;                                                         \
-      }                                                                 \
-                                                                        \
-    if (alsa_card_data->pulse_object_name != NULL)                      \
-      {                                                                 \
-        /* Already found our object */                                  \
-        g_debug ("Skipping " #object_type                               \
-                 " %" PRIu32 " `%s'",                                   \
-                 info->index, info->name);                              \
-        return;                                                         \
-      }                                                                 \
-                                                                        \
-    g_assert (info != NULL);                                            \
-                                                                        \
-    if (!props_name_alsa_card (info->proplist,                          \
-                               alsa_card_data->alsa_card_name))         \
-      {                                                                 \
-        g_debug ("The " #object_type " %" PRIu32                        \
-                 " `%s' is not ALSA card `%s'",                         \
-                 info->index,                                           \
-                 info->name,                                            \
-                 alsa_card_data->alsa_card_name);                       \
-        return;                                                         \
-      }                                                                 \
-                                                                        \
-    g_debug ("The " #object_type " %" PRIu32                            \
-             " `%s' is ALSA card `%s'",                                 \
-             info->index,                                               \
-             info->name,                                                \
-             alsa_card_data->alsa_card_name);                           \
-    alsa_card_data->pulse_object_name = g_strdup (info->name);          \
-  }
+  if (sample && control->sample_id == 0)
+    {
+      g_debug ("Sampling loopback %s latency",
+               wys_direction_get_description (direction));
 
+      control->samples = control->over = 0;
 
-#define FIND_ALSA_CARD(object_type)                             \
-  static void                                                   \
-  find_alsa_card_##object_type (pa_context *ctx,                \
-                                const gchar *alsa_card_name,    \
-                                GCallback callback,             \
-                                gpointer userdata)              \
-  {                                                             \
-    pa_operation *op;                                           \
-    struct find_alsa_card_data *data;                           \
-                                                                \
-    data = find_alsa_card_data_new (alsa_card_name);            \
-    data->callback = callback;                                  \
-    data->userdata = userdata;                                  \
-                                                                \
-    op = pa_context_get_##object_type##_info_list               \
-      (ctx, find_alsa_card_##object_type##list_cb, data);       \
-                                                                \
-    pa_operation_unref (op);                                    \
-  }
+      timeout = g_new (struct latency_timeout_data, 1);
+      timeout->self = self;
+      timeout->direction = direction;
 
-#define DECLARE_FIND_ALSA_CARD(object_type)     \
-  FIND_ALSA_CARD_LIST_CB(object_type)           \
-  FIND_ALSA_CARD(object_type)
+      control->sample_id =
+        g_timeout_add_full (G_PRIORITY_DEFAULT,
+                            LATENCY_SAMPLE_MSEC,
+                            (GSourceFunc)latency_sample_cb,
+                            timeout, g_free);
+    }
+  else if (!sample && control->sample_id != 0)
+    {
+      g_clear_handle_id (&control->sample_id, g_source_remove);
 
+      if (self->adaptive && !self->audio[direction])
+        {
+          latency_lower (self, direction);
+        }
+    }
 
-DECLARE_FIND_ALSA_CARD(source);
-DECLARE_FIND_ALSA_CARD(sink);
+  if (!self->audio[direction])
+    {
+      /* Each call starts with a clean slate */
+      control->glitched = FALSE;
+      telemetry_report (self, direction);
+    }
+}
 
 
-/**************** Instantiate loopback data ****************/
+/**************** Echo canceller ****************/
 
-typedef void (*InstantiateLoopbackCallback) (gchar *alsa_card,
-                                             WysDirection direction,
-                                             gchar *master,
-                                             gpointer userdata);
+static inline gboolean
+echo_cancel_ready (WysAudio *self)
+{
+  return !self->echo_cancel
+    || self->echo_cancel_module != PA_INVALID_INDEX
+    || self->echo_cancel_failed;
+}
 
 
-struct instantiate_loopback_data
+/** Whether the loopbacks attach to our echo canceller rather than
+    asking filter-apply for one */
+static inline gboolean
+echo_cancel_attached (WysAudio *self)
 {
-  pa_context *ctx;
-  gchar *alsa_card;
-  WysDirection direction;
-  gchar *media_name;
-  gchar *master;
-};
+  return self->echo_cancel
+    && self->echo_cancel_module != PA_INVALID_INDEX;
+}
 
 
-static struct instantiate_loopback_data *
-instantiate_loopback_data_new (pa_context *ctx,
-                               const gchar *alsa_card,
-                               WysDirection direction,
-                               const gchar *media_name)
+/** How many instances use our echo canceller.  All routes share the
+    one named ECHO_CANCEL_SINK, so it is only unloaded once none of
+    them use it any more. */
+static guint echo_cancel_users = 0;
+
+
+/** Set the index of the echo canceller we use, keeping count of its
+    users */
+static void
+echo_cancel_set_module (WysAudio *self,
+                        uint32_t  index)
 {
-  struct instantiate_loopback_data *data;
+  if (self->echo_cancel_module == PA_INVALID_INDEX
+      && index != PA_INVALID_INDEX)
+    {
+      ++echo_cancel_users;
+    }
+  else if (self->echo_cancel_module != PA_INVALID_INDEX
+           && index == PA_INVALID_INDEX)
+    {
+      g_assert (echo_cancel_users > 0);
+      --echo_cancel_users;
+    }
 
-  data = g_rc_box_new0 (struct instantiate_loopback_data);
+  self->echo_cancel_module = index;
+}
 
-  pa_context_ref (ctx);
-  data->ctx = ctx;
 
-  data->alsa_card = g_strdup (alsa_card);
-  data->direction = direction;
-  data->media_name = g_strdup (media_name);
+static void
+echo_cancel_unload_cb (pa_context *ctx,
+                       int         success,
+                       void       *userdata)
+{
+  WysAudio *self = userdata;
 
-  return data;
+  TRACE_OP_END ("unload_module", self);
+  if (!success)
+    {
+      g_warning ("Error unloading echo canceller: %s",
+                 pa_strerror (pa_context_errno (ctx)));
+    }
+
+  --self->echo_cancel_unloads;
+  g_object_unref (self);
 }
 
 
+/** Unload an echo canceller module.  The operation holds a reference
+    so that a released instance keeps its context until the server
+    has seen the request. */
 static void
-instantiate_loopback_data_clear (struct instantiate_loopback_data *data)
+echo_cancel_unload (WysAudio *self,
+                    uint32_t  index)
 {
-  g_free (data->master);
-  g_free (data->media_name);
-  g_free (data->alsa_card);
-  pa_context_unref (data->ctx);
+  pa_operation *op;
+
+  g_debug ("Unloading echo canceller module %" PRIu32, index);
+
+  TRACE_OP_BEGIN ("unload_module", self);
+  op = pa_context_unload_module (self->ctx, index,
+                                 echo_cancel_unload_cb,
+                                 g_object_ref (self));
+  if (op)
+    {
+      ++self->echo_cancel_unloads;
+      pa_operation_unref (op);
+    }
+  else
+    {
+      g_warning ("Error unloading echo canceller module %" PRIu32 ": %s",
+                 index, pa_strerror (pa_context_errno (self->ctx)));
+      g_object_unref (self);
+    }
 }
 
 
-static inline void
-instantiate_loopback_data_release (struct instantiate_loopback_data *data)
+/** Once the echo canceller we loaded has been checked, let it go if
+    we let the modem card go, or were released, in the meantime */
+static void
+echo_cancel_checked (WysAudio *self)
 {
-  g_rc_box_release_full (data, (GDestroyNotify)instantiate_loopback_data_clear);
+  if (!self->modem || self->released)
+    {
+      echo_cancel_release (self);
+    }
+}
+
+
+static void
+echo_cancel_check_cb (pa_context         *ctx,
+                      const pa_sink_info *info,
+                      int                 eol,
+                      void               *userdata)
+{
+  WysAudio *self = userdata;
+
+  if (eol < 0)
+    {
+      g_warning ("Error getting echo canceller sink: %s",
+                 pa_strerror (pa_context_errno (ctx)));
+    }
+
+  if (eol != 0)
+    {
+      TRACE_OP_END ("get_sink_info", self);
+      g_clear_pointer (&self->echo_cancel_op, pa_operation_unref);
+      echo_cancel_checked (self);
+      g_object_unref (self);
+      return;
+    }
+
+  if (self->echo_cancel_module == PA_INVALID_INDEX
+      || info->owner_module == self->echo_cancel_module)
+    {
+      /* Unloaded in the meantime, or ours is the one */
+      return;
+    }
+
+  /* Another route loaded one at the same time and got the name;
+     the loopbacks attach to that one, so use it and drop ours */
+  g_debug ("Echo canceller module %" PRIu32 " loaded first, using it"
+           " instead of %" PRIu32,
+           info->owner_module, self->echo_cancel_module);
+  echo_cancel_unload (self, self->echo_cancel_module);
+  self->echo_cancel_module = info->owner_module;
+}
+
+
+/** Make sure that the echo canceller we loaded is the one with our
+    sink name, and not a duplicate loaded alongside another route's */
+static void
+echo_cancel_check (WysAudio *self)
+{
+  pa_operation *op;
+
+  TRACE_OP_BEGIN ("get_sink_info", self);
+  op = pa_context_get_sink_info_by_name (self->ctx, ECHO_CANCEL_SINK,
+                                         echo_cancel_check_cb,
+                                         g_object_ref (self));
+  if (!op)
+    {
+      g_warning ("Error getting echo canceller sink: %s",
+                 pa_strerror (pa_context_errno (self->ctx)));
+      echo_cancel_checked (self);
+      g_object_unref (self);
+      return;
+    }
+
+  self->echo_cancel_op = op;
+}
+
+
+/** Quote a module argument value, escaping the characters that
+    would end it early */
+static gchar *
+module_arg_quote (const gchar *value)
+{
+  GString *quoted = g_string_new ("\"");
+  const gchar *c;
+
+  for (c = value; *c; ++c)
+    {
+      if (*c == '"' || *c == '\\')
+        {
+          g_string_append_c (quoted, '\\');
+        }
+      g_string_append_c (quoted, *c);
+    }
+
+  g_string_append_c (quoted, '"');
+  return g_string_free (quoted, FALSE);
+}
+
+
+static gboolean
+echo_cancel_retry_cb (WysAudio *self)
+{
+  self->echo_cancel_retry_id = 0;
+  echo_cancel_update (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/** Let the loopbacks fall back to filter-apply, so that calls still
+    get audio, and try to load the echo canceller again after a
+    delay */
+static void
+echo_cancel_load_failed (WysAudio *self)
+{
+  self->echo_cancel_failed = TRUE;
+  self->echo_cancel_retry_delay =
+    CLAMP (self->echo_cancel_retry_delay * 2,
+           ECHO_CANCEL_RETRY_MIN_MSEC, ECHO_CANCEL_RETRY_MAX_MSEC);
+
+  g_debug ("Using filter-apply for the loopbacks, loading the echo"
+           " canceller again in %ums", self->echo_cancel_retry_delay);
+
+  self->echo_cancel_retry_id =
+    g_timeout_add (self->echo_cancel_retry_delay,
+                   (GSourceFunc)echo_cancel_retry_cb, self);
+
+  update_loopbacks (self);
+}
+
+
+static void
+echo_cancel_load_cb (pa_context *ctx,
+                     uint32_t    index,
+                     void       *userdata)
+{
+  WysAudio *self = userdata;
+
+  TRACE_OP_END ("load_module", self);
+  g_clear_pointer (&self->echo_cancel_op, pa_operation_unref);
+
+  if (index == PA_INVALID_INDEX)
+    {
+      g_warning ("Error loading echo canceller: %s",
+                 pa_strerror (pa_context_errno (ctx)));
+      echo_cancel_load_failed (self);
+      g_object_unref (self);
+      return;
+    }
+
+  g_debug ("Loaded echo canceller module %" PRIu32, index);
+  echo_cancel_set_module (self, index);
+  self->echo_cancel_failed = FALSE;
+  self->echo_cancel_retry_delay = 0;
+  echo_cancel_check (self);
+  update_loopbacks (self);
+
+  g_object_unref (self);
+}
+
+
+/** Whether a space-separated list property holds a word */
+static gboolean
+prop_has_word (pa_proplist *props,
+               const gchar *key,
+               const gchar *word)
+{
+  gchar **words;
+  gboolean found;
+  const char *value;
+
+  value = pa_proplist_gets (props, key);
+  if (!value)
+    {
+      return FALSE;
+    }
+
+  words = g_strsplit (value, " ", -1);
+  found = g_strv_contains ((const gchar * const *)words, word);
+  g_strfreev (words);
+
+  return found;
+}
+
+
+/** The sink or source that call audio would play to or record from
+    without our echo canceller: the one meant for phone calls, if
+    any, or else the server's default.  Never the modem's own, which
+    is the other end of the loopbacks, nor a monitor or another
+    filter; NULL leaves the choice to module-echo-cancel. */
+static const gchar *
+echo_cancel_master (WysAudio        *self,
+                    enum cache_kind  kind,
+                    const gchar     *default_name)
+{
+  GHashTableIter iter;
+  struct cache_object *object, *found = NULL;
+
+  g_hash_table_iter_init (&iter, self->cache[kind]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&object))
+    {
+      if (props_name_alsa_card (object->proplist, self->modem)
+          || prop_matches (object->proplist, "device.class", "monitor")
+          || prop_matches (object->proplist, "device.class", "filter")
+          || !prop_has_word (object->proplist,
+                             "device.intended_roles", "phone"))
+        {
+          continue;
+        }
+
+      if (!found || object->index < found->index)
+        {
+          found = object;
+        }
+    }
+
+  if (found)
+    {
+      return found->name;
+    }
+
+  g_hash_table_iter_init (&iter, self->cache[kind]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&object))
+    {
+      if (g_strcmp0 (object->name, default_name) == 0
+          && props_name_alsa_card (object->proplist, self->modem))
+        {
+          return NULL;
+        }
+    }
+
+  return default_name;
 }
 
 
-/**************** Instantiate loopback ****************/
+static void
+echo_cancel_load_module (WysAudio    *self,
+                         const gchar *sink_master,
+                         const gchar *source_master)
+{
+  GString *arg;
+  pa_operation *op;
+
+  arg = g_string_new ("sink_name=" ECHO_CANCEL_SINK
+                      " source_name=" ECHO_CANCEL_SOURCE
+                      " use_master_format=true");
+
+#define append_quoted(name, value)                              \
+  if (value)                                                    \
+    {                                                           \
+      g_autofree gchar *quoted = module_arg_quote (value);      \
+      g_string_append_printf (arg, " " name "=%s", quoted);     \
+    }
+
+  append_quoted ("sink_master",   sink_master);
+  append_quoted ("source_master", source_master);
+  append_quoted ("aec_method",    self->aec_method);
+  append_quoted ("aec_args",      self->aec_args);
+
+#undef append_quoted
+
+  g_debug ("Loading echo canceller with arguments `%s'", arg->str);
+
+  TRACE_OP_BEGIN ("load_module", self);
+  op = pa_context_load_module (self->ctx, "module-echo-cancel", arg->str,
+                               echo_cancel_load_cb,
+                               g_object_ref (self));
+  g_string_free (arg, TRUE);
+  if (!op)
+    {
+      g_warning ("Error loading echo canceller: %s",
+                 pa_strerror (pa_context_errno (self->ctx)));
+      echo_cancel_load_failed (self);
+      g_object_unref (self);
+      return;
+    }
+
+  self->echo_cancel_op = op;
+}
+
 
 static void
-instantiate_loopback_load_module_cb (pa_context *ctx,
-                                     uint32_t index,
-                                     void *userdata)
+echo_cancel_server_info_cb (pa_context           *ctx,
+                            const pa_server_info *info,
+                            void                 *userdata)
 {
-  struct instantiate_loopback_data *data = userdata;
+  WysAudio *self = userdata;
 
-  if (index == PA_INVALID_INDEX)
+  TRACE_OP_END ("get_server_info", self);
+  g_clear_pointer (&self->echo_cancel_op, pa_operation_unref);
+
+  if (!info)
     {
-      g_warning ("Error instantiating loopback module with %s `%s'"
-                 " (ALSA card `%s'): %s",
-                 data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
-                 data->master,
-                 data->alsa_card,
+      g_warning ("Error getting PulseAudio server information: %s",
                  pa_strerror (pa_context_errno (ctx)));
+      echo_cancel_load_failed (self);
     }
   else
     {
-      g_debug ("Instantiated loopback module %" PRIu32
-               " with %s `%s' (ALSA card `%s')",
-               index,
-               data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
-               data->master,
-               data->alsa_card);
+      echo_cancel_load_module
+        (self,
+         echo_cancel_master (self, CACHE_SINK, info->default_sink_name),
+         echo_cancel_master (self, CACHE_SOURCE,
+                             info->default_source_name));
     }
 
-  instantiate_loopback_data_release (data);
+  g_object_unref (self);
 }
 
 
+/** Load our echo canceller on the speaker and microphone that the
+    loopbacks would use without it, which needs the server's
+    defaults */
 static void
-instantiate_loopback_load_module (struct instantiate_loopback_data *data)
+echo_cancel_load (WysAudio *self)
 {
-  pa_proplist *stream_props;
-  gchar *stream_sink_props_str, *stream_source_props_str;
-  gchar *arg;
   pa_operation *op;
 
-  g_debug ("Instantiating loopback module with %s `%s'"
-           " (ALSA card `%s')",
-           data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
-           data->master,
-           data->alsa_card);
+  TRACE_OP_BEGIN ("get_server_info", self);
+  op = pa_context_get_server_info (self->ctx, echo_cancel_server_info_cb,
+                                   g_object_ref (self));
+  if (!op)
+    {
+      g_warning ("Error getting PulseAudio server information: %s",
+                 pa_strerror (pa_context_errno (self->ctx)));
+      echo_cancel_load_failed (self);
+      g_object_unref (self);
+      return;
+    }
 
-  // sink properties
-  stream_props = pa_proplist_new ();
-  g_assert (stream_props != NULL);
-  proplist_set (stream_props, "media.role", "phone");
-  proplist_set (stream_props, "media.icon_name", "phone");
-  proplist_set (stream_props, "media.name", data->media_name);
-  if (data->direction == WYS_DIRECTION_FROM_NETWORK)
+  self->echo_cancel_op = op;
+}
+
+
+/** Find an echo canceller we loaded before, perhaps in an earlier
+    run, by the name of its sink */
+static uint32_t
+echo_cancel_find (WysAudio *self)
+{
+  GHashTableIter iter;
+  struct cache_object *sink;
+
+  g_hash_table_iter_init (&iter, self->cache[CACHE_SINK]);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&sink))
     {
-      proplist_set (stream_props, "filter.want", "echo-cancel");
+      if (g_strcmp0 (sink->name, ECHO_CANCEL_SINK) == 0)
+        {
+          return sink->owner_module;
+        }
     }
 
-  stream_sink_props_str = pa_proplist_to_string (stream_props);
-  pa_proplist_free (stream_props);
+  return PA_INVALID_INDEX;
+}
 
-  // source properties
-  stream_props = pa_proplist_new ();
-  g_assert (stream_props != NULL);
-  proplist_set (stream_props, "media.role", "phone");
-  proplist_set (stream_props, "media.icon_name", "phone");
-  proplist_set (stream_props, "media.name", data->media_name);
-  if (data->direction == WYS_DIRECTION_TO_NETWORK)
+
+/** Make sure our echo canceller is loaded once we know the state of
+    the server and there is a modem to use it with.  It stays loaded
+    from then on, so calls don't wait for filter-apply to load one
+    and for it to converge. */
+static void
+echo_cancel_update (WysAudio *self)
+{
+  if (!self->echo_cancel
+      || self->released
+      || !self->cache_synced
+      || !self->modem
+      || self->echo_cancel_module != PA_INVALID_INDEX
+      || self->echo_cancel_op
+      || self->echo_cancel_retry_id)
     {
-      proplist_set (stream_props, "filter.want", "echo-cancel");
+      return;
     }
 
-  stream_source_props_str = pa_proplist_to_string (stream_props);
-  pa_proplist_free (stream_props);
+  echo_cancel_set_module (self, echo_cancel_find (self));
+  if (self->echo_cancel_module != PA_INVALID_INDEX)
+    {
+      g_debug ("Found echo canceller module %" PRIu32,
+               self->echo_cancel_module);
+      return;
+    }
 
-  arg = g_strdup_printf ("%s=%s"
-                         " %s_dont_move=true"
-                         " fast_adjust_threshold_msec=100"
-                         " max_latency_msec=25"
-                         " sink_input_properties='%s'"
-                         " source_output_properties='%s'",
-                         data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
-                         data->master,
-                         data->direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink",
-                         stream_sink_props_str,
-                         stream_source_props_str);
-  pa_xfree (stream_sink_props_str);
-  pa_xfree (stream_source_props_str);
+  echo_cancel_load (self);
+}
 
-  op = pa_context_load_module (data->ctx,
-                               "module-loopback",
-                               arg,
-                               instantiate_loopback_load_module_cb,
-                               data);
 
-  pa_operation_unref (op);
-  g_free (arg);
+static void
+echo_cancel_module_removed (WysAudio *self,
+                            uint32_t  index)
+{
+  if (index == PA_INVALID_INDEX
+      || index != self->echo_cancel_module)
+    {
+      return;
+    }
+
+  g_warning ("Echo canceller module %" PRIu32 " was unloaded", index);
+  echo_cancel_set_module (self, PA_INVALID_INDEX);
+
+  /* The loopbacks attached to it go with it; load it again */
+  echo_cancel_update (self);
 }
 
+
+/** Stop using our echo canceller, once we have no modem card to use
+    it with any more, and unload it unless another route still uses
+    it */
 static void
-instantiate_loopback_master_cb (const gchar *alsa_card_name,
-                                const gchar *pulse_object_name,
-                                gpointer userdata)
+echo_cancel_release (WysAudio *self)
 {
-  struct instantiate_loopback_data *data = userdata;
+  const uint32_t index = self->echo_cancel_module;
 
-  if (!pulse_object_name)
+  if (index == PA_INVALID_INDEX || self->echo_cancel_op)
     {
-      g_warning ("Could not find source/sink for ALSA card `%s'",
-                 alsa_card_name);
-      instantiate_loopback_data_release (data);
+      /* Any load or check in progress releases it once it is done */
       return;
     }
 
-  data->master = g_strdup (pulse_object_name);
+  echo_cancel_set_module (self, PA_INVALID_INDEX);
+  if (echo_cancel_users > 0)
+    {
+      g_debug ("Leaving echo canceller module %" PRIu32
+               " to the other routes", index);
+      return;
+    }
 
-  instantiate_loopback_load_module (data);
+  echo_cancel_unload (self, index);
 }
 
 
 static void
-instantiate_loopback (pa_context *ctx,
-                      const gchar *alsa_card,
-                      WysDirection direction,
-                      const gchar *media_name)
+echo_cancel_reset (WysAudio *self)
 {
-  struct instantiate_loopback_data *loopback_data;
-
-  loopback_data = instantiate_loopback_data_new (ctx,
-                                                 alsa_card,
-                                                 direction,
-                                                 media_name);
+  if (self->echo_cancel_op)
+    {
+      /* The context has cancelled the operation, so the callback
+         won't drop its reference */
+      g_clear_pointer (&self->echo_cancel_op, pa_operation_unref);
+      g_object_unref (self);
+    }
 
-  switch (direction)
+  /* Nor the unloads' */
+  for (; self->echo_cancel_unloads > 0; --self->echo_cancel_unloads)
     {
-    case WYS_DIRECTION_FROM_NETWORK:
-      g_debug ("Finding source for ALSA card `%s'", alsa_card);
-      find_alsa_card_source (ctx,
-                             alsa_card,
-                             G_CALLBACK (instantiate_loopback_master_cb),
-                             loopback_data);
-      break;
-    case WYS_DIRECTION_TO_NETWORK:
-      g_debug ("Finding sink for ALSA card `%s'", alsa_card);
-      find_alsa_card_sink (ctx,
-                           alsa_card,
-                           G_CALLBACK (instantiate_loopback_master_cb),
-                           loopback_data);
-      break;
-    default:
-      break;
+      g_object_unref (self);
     }
+
+  /* Try again as soon as we are reconnected */
+  g_clear_handle_id (&self->echo_cancel_retry_id, g_source_remove);
+  self->echo_cancel_failed = FALSE;
+  echo_cancel_set_module (self, PA_INVALID_INDEX);
 }
 
 
-/**************** Ensure loopback ****************/
+/**************** Setup spans ****************/
 
-struct ensure_loopback_data
+static const gchar * const SPAN_STAGE_NAMES[] =
+  {
+   [SPAN_WAIT]     = "wait",
+   [SPAN_DISCOVER] = "discover",
+   [SPAN_DEVICE]   = "device",
+   [SPAN_LOAD]     = "load",
+   [SPAN_STREAM]   = "stream",
+   [SPAN_UNLOAD]   = "unload",
+   [SPAN_SETUP]    = "setup",
+   [SPAN_TEARDOWN] = "teardown"
+  };
+
+
+static inline gdouble
+span_msec (gint64 start,
+           gint64 end)
 {
-  pa_context *ctx;
-  const gchar *media_name;
-};
+  return (gdouble)(end - start) / 1000.0;
+}
 
 
 static void
-ensure_loopback_find_loopback_cb (gchar *alsa_card,
-                                  WysDirection direction,
-                                  GList *modules,
-                                  struct ensure_loopback_data *data)
+span_record (WysAudio        *self,
+             WysDirection     direction,
+             enum span_stage  stage,
+             gint64           start,
+             gint64           end)
 {
-  if (modules != NULL)
-    {
-      g_warning ("%u loopback module(s) for ALSA card `%s' %s ->"
-                 " already exist",
-                 g_list_length (modules),
-                 alsa_card,
-                 direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
-    }
-  else
-    {
-      g_debug ("Instantiating loopback module for ALSA card `%s' %s",
-               alsa_card,
-               direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
+  const gdouble msec = span_msec (start, end);
 
-      instantiate_loopback (data->ctx, alsa_card,
-                            direction, data->media_name);
-    }
+  wys_flight_record (&FLIGHT_SPAN_STAGE,
+                     wys_direction_get_description (direction),
+                     SPAN_STAGE_NAMES[stage], end - start, 0, 0, NULL);
+  wys_trace_complete ("loopback", SPAN_STAGE_NAMES[stage], start, end);
 
-  g_free (data);
+  wys_histogram_record (self->span_stats[stage], (guint32)(msec + 0.5));
 }
 
 
+/** Start timing the setup or teardown of the loopback.  The signals
+    from call_state_changed_cb() in wys-modem.c to here are
+    synchronous, so this is when the call's audio state changed. */
 static void
-ensure_loopback (pa_context *ctx,
-                 const gchar *alsa_card,
-                 WysDirection  direction,
-                 const gchar *media_name)
+span_begin (WysAudio     *self,
+            WysDirection  direction,
+            gboolean      teardown)
 {
-  struct ensure_loopback_data *data;
+  struct span *span = &self->spans[direction];
 
-  data = g_new (struct ensure_loopback_data, 1);
-  data->ctx = ctx;
-  // This is a static string so we don't need a copy
-  data->media_name = media_name;
-  find_loopback (ctx, alsa_card, direction,
-                 G_CALLBACK (ensure_loopback_find_loopback_cb),
-                 data);
+  span->start = span->stage_start = g_get_monotonic_time ();
+  span->stage = teardown ? SPAN_UNLOAD : SPAN_WAIT;
+  span->teardown = teardown;
 }
 
 
-void
-wys_audio_ensure_loopback (WysAudio     *self,
-                           WysDirection  direction)
+/** Move on to the next stage, recording how long the last one
+    took */
+static void
+span_stage (WysAudio        *self,
+            WysDirection     direction,
+            enum span_stage  stage)
 {
-  g_return_if_fail (WYS_IS_AUDIO (self));
-  g_return_if_fail (self->modem);
+  struct span *span = &self->spans[direction];
+  gint64 now;
 
-  switch (direction)
+  if (span->start == 0 || span->stage == stage)
     {
-    case WYS_DIRECTION_FROM_NETWORK:
-      ensure_loopback (self->ctx, self->modem, direction,
-                       "Voice call audio (to speaker)");
-      break;
-    case WYS_DIRECTION_TO_NETWORK:
-      ensure_loopback (self->ctx, self->modem, direction,
-                       "Voice call audio (from mic)");
-      break;
-    default:
-      break;
+      return;
     }
-}
 
+  now = g_get_monotonic_time ();
+  span_record (self, direction, span->stage, span->stage_start, now);
+  span->stage = stage;
+  span->stage_start = now;
+}
 
-/**************** Ensure no loopback ****************/
 
 static void
-ensure_no_loopback_unload_module_cb (pa_context *ctx,
-                                     int success,
-                                     void *userdata)
+span_end (WysAudio     *self,
+          WysDirection  direction,
+          gboolean      teardown)
 {
-  const guint module_index = GPOINTER_TO_UINT (userdata);
+  struct span *span = &self->spans[direction];
+  gint64 now;
 
-  if (success)
-    {
-      g_debug ("Successfully deinstantiated loopback module %u",
-               module_index);
-    }
-  else
+  if (span->start == 0 || span->teardown != teardown)
     {
-      g_warning ("Error deinstantiating loopback module %u: %s",
-                 module_index,
-                 pa_strerror (pa_context_errno (ctx)));
+      return;
     }
+
+  now = g_get_monotonic_time ();
+  span_record (self, direction, span->stage, span->stage_start, now);
+  span_record (self, direction,
+               teardown ? SPAN_TEARDOWN : SPAN_SETUP,
+               span->start, now);
+  span->start = 0;
 }
 
 
+/** Forget a setup that didn't get as far as a running loopback */
 static void
-ensure_no_loopback_modules_cb (gpointer data,
-                               pa_context *ctx)
+span_abandon (WysAudio     *self,
+              WysDirection  direction)
 {
-  const uint32_t module_index = GPOINTER_TO_UINT (data);
-  pa_operation *op;
+  struct span *span = &self->spans[direction];
 
-  g_debug ("Deinstantiating loopback module %" PRIu32,
-           module_index);
-
-  op = pa_context_unload_module (ctx,
-                                 module_index,
-                                 ensure_no_loopback_unload_module_cb,
-                                 data);
+  if (span->start == 0 || span->teardown)
+    {
+      return;
+    }
 
-  pa_operation_unref (op);
+  g_debug ("Loopback %s setup abandoned in %s stage after %.1fms",
+           wys_direction_get_description (direction),
+           SPAN_STAGE_NAMES[span->stage],
+           span_msec (span->start, g_get_monotonic_time ()));
+  span->start = 0;
 }
 
 
+/** The setup is complete once both of the new module's streams are
+    in the cache, which may be before or after the load callback */
 static void
-ensure_no_loopback_find_loopback_cb (gchar *alsa_card,
-                                     WysDirection direction,
-                                     GList *modules,
-                                     pa_context *ctx)
+span_streams_check (WysAudio     *self,
+                    WysDirection  direction)
 {
-  if (modules == NULL)
+  const uint32_t module = self->loopbacks[direction].module;
+
+  if (self->spans[direction].start == 0
+      || self->spans[direction].stage != SPAN_STREAM
+      || module == PA_INVALID_INDEX)
     {
-      g_warning ("No loopback module(s) for ALSA card `%s' %s",
-                 alsa_card,
-                 direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
       return;
     }
 
-  g_debug ("Deinstantiating loopback modules for ALSA card `%s' %s",
-           alsa_card,
-           direction == WYS_DIRECTION_FROM_NETWORK ? "source" : "sink");
-
-  g_list_foreach (modules,
-                  (GFunc)ensure_no_loopback_modules_cb,
-                  ctx);
+  if (latency_find_stream (self, CACHE_SINK_INPUT, module)
+      && latency_find_stream (self, CACHE_SOURCE_OUTPUT, module))
+    {
+      span_end (self, direction, FALSE);
+    }
 }
 
 
-static void
-ensure_no_loopback (pa_context *ctx,
-                    const gchar *alsa_card,
-                    WysDirection direction)
+/**
+ * wys_audio_log_stats:
+ * @self: A #WysAudio.
+ *
+ * Log the distribution of the time taken by each stage of setting up
+ * and tearing down loopbacks, and in total, since start-up.
+ */
+void
+wys_audio_log_stats (WysAudio *self)
 {
-  find_loopback (ctx, alsa_card, direction,
-                 G_CALLBACK (ensure_no_loopback_find_loopback_cb),
-                 ctx);
+  enum span_stage stage;
+
+  g_return_if_fail (WYS_IS_AUDIO (self));
+
+  for (stage = 0; stage < SPAN_LAST; ++stage)
+    {
+      g_autofree gchar *stats =
+        wys_histogram_to_string (self->span_stats[stage]);
+
+      g_message ("Loopback %s (ms): %s",
+                 SPAN_STAGE_NAMES[stage], stats);
+    }
 }
 
 
-void
-wys_audio_ensure_no_loopback (WysAudio     *self,
-                              WysDirection  direction)
+/**
+ * wys_audio_write_stats:
+ * @self: A #WysAudio.
+ * @filename: The file to write.
+ * @error: Return location for a #GError.
+ *
+ * Write the same statistics as wys_audio_log_stats() to @filename as
+ * a key file, with a group for each stage, for scripts to read.
+ * Times are in milliseconds.  The "graph" group gives the number of
+ * each kind of PulseAudio object, so that scripts can relate the
+ * discovery times to the size of the PulseAudio graph.
+ *
+ * Returns: Whether the file was written.
+ */
+gboolean
+wys_audio_write_stats (WysAudio     *self,
+                       const gchar  *filename,
+                       GError      **error)
 {
-  g_return_if_fail (WYS_IS_AUDIO (self));
-  g_return_if_fail (self->modem);
+  static const gchar * const GRAPH_KEYS[] =
+    {
+     [CACHE_SINK]          = "sinks",
+     [CACHE_SOURCE]        = "sources",
+     [CACHE_MODULE]        = "modules",
+     [CACHE_SINK_INPUT]    = "sink-inputs",
+     [CACHE_SOURCE_OUTPUT] = "source-outputs",
+     [CACHE_CARD]          = "cards"
+    };
+  GKeyFile *key_file;
+  enum span_stage stage;
+  enum cache_kind kind;
+  gboolean ok;
+
+  g_return_val_if_fail (WYS_IS_AUDIO (self), FALSE);
+
+  key_file = g_key_file_new ();
+
+  for (stage = 0; stage < SPAN_LAST; ++stage)
+    {
+      const WysHistogram *stats = self->span_stats[stage];
+      const gchar *group = SPAN_STAGE_NAMES[stage];
+
+#define set(key, value) g_key_file_set_uint64 (key_file, group, key, value)
+
+      set ("count", wys_histogram_get_count (stats));
+      set ("min",   wys_histogram_get_min (stats));
+      set ("p50",   wys_histogram_get_percentile (stats, 50.0));
+      set ("p90",   wys_histogram_get_percentile (stats, 90.0));
+      set ("p99",   wys_histogram_get_percentile (stats, 99.0));
+      set ("max",   wys_histogram_get_max (stats));
+
+#undef set
+
+      g_key_file_set_double (key_file, group, "mean",
+                             wys_histogram_get_mean (stats));
+    }
+
+  for (kind = 0; kind < CACHE_LAST; ++kind)
+    {
+      g_key_file_set_uint64 (key_file, "graph", GRAPH_KEYS[kind],
+                             g_hash_table_size (self->cache[kind]));
+    }
+
+  ok = g_key_file_save_to_file (key_file, filename, error);
+  g_key_file_free (key_file);
 
-  ensure_no_loopback (self->ctx, self->modem, direction);
+  return ok;
 }
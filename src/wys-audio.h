@@ -35,11 +35,48 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (WysAudio, wys_audio, WYS, AUDIO, GObject);
 
-WysAudio *wys_audio_new                (const gchar  *modem);
+/** How to build the loopbacks.  Fields that are 0 or NULL leave the
+    choice to the modem's devices or to PulseAudio. */
+struct wys_audio_profile
+{
+  /** Sample spec of the loopback streams, overriding the modem's */
+  gchar    *sample_format;
+  guint     sample_rate;
+  guint     channels;
+  /** PulseAudio resampler */
+  gchar    *resample_method;
+  /** Target latency in milliseconds */
+  guint     latency;
+  /** module-loopback's fast_adjust_threshold_msec and adjust_time
+      (in seconds) */
+  guint     adjust_threshold;
+  guint     adjust_time;
+  /** Whether to adapt the latency to what the devices can sustain,
+      and the bounds in milliseconds */
+  gboolean  adaptive_latency;
+  guint     latency_min;
+  guint     latency_max;
+  /** Whether to keep our own echo canceller loaded for the loopbacks
+      to attach to, and module-echo-cancel's aec_method and aec_args */
+  gboolean  echo_cancel;
+  gchar    *aec_method;
+  gchar    *aec_args;
+};
+
+WysAudio *wys_audio_new                (const gchar                     *modem,
+                                        gboolean                         standby,
+                                        const struct wys_audio_profile  *profile);
 void      wys_audio_ensure_loopback    (WysAudio     *self,
                                         WysDirection  direction);
 void      wys_audio_ensure_no_loopback (WysAudio     *self,
                                         WysDirection  direction);
+void      wys_audio_exclude_card       (WysAudio     *self,
+                                        const gchar  *alsa_card);
+void      wys_audio_release            (WysAudio     *self);
+void      wys_audio_log_stats          (WysAudio     *self);
+gboolean  wys_audio_write_stats        (WysAudio     *self,
+                                        const gchar  *filename,
+                                        GError      **error);
 
 G_END_DECLS
 
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+
+#include "wys-flight.h"
+
+
+/** One recorded event.  The strings must be static; the text is
+    copied, truncated if need be. */
+struct flight_event
+{
+  gint64 time;
+  const WysFlightKind *kind;
+  const gchar *str[2];
+  guint32 num[3];
+  gchar text[WYS_FLIGHT_TEXT_LEN];
+};
+
+
+/** The ring of events and the total number ever recorded.  Wys only
+    records and dumps from the main loop, so the ring needs no
+    locking. */
+static struct flight_event ring[WYS_FLIGHT_EVENTS];
+static guint64 recorded = 0;
+
+
+/**
+ * wys_flight_record:
+ * @kind: The kind of event.
+ * @str0: (nullable): A static string.
+ * @str1: (nullable): A static string.
+ * @num0: A number.
+ * @num1: A number.
+ * @num2: A number.
+ * @text: (nullable): A string to copy.
+ *
+ * Record an event in the flight recorder, overwriting the oldest
+ * one if the ring is full.  Nothing is formatted until the ring is
+ * dumped.
+ */
+void
+wys_flight_record (const WysFlightKind *kind,
+                   const gchar         *str0,
+                   const gchar         *str1,
+                   guint32              num0,
+                   guint32              num1,
+                   guint32              num2,
+                   const gchar         *text)
+{
+  struct flight_event *event = &ring[recorded % WYS_FLIGHT_EVENTS];
+
+  event->time = g_get_monotonic_time ();
+  event->kind = kind;
+  event->str[0] = str0;
+  event->str[1] = str1;
+  event->num[0] = num0;
+  event->num[1] = num1;
+  event->num[2] = num2;
+  if (text)
+    {
+      g_strlcpy (event->text, text, WYS_FLIGHT_TEXT_LEN);
+    }
+  else
+    {
+      event->text[0] = '\0';
+    }
+
+  ++recorded;
+}
+
+
+static void
+format_event (GString                   *out,
+              const struct flight_event *event,
+              gint64                     now)
+{
+  const WysFlightKind *kind = event->kind;
+  guint i;
+
+  g_string_append_printf (out, "%12.6fs %s",
+                          (event->time - now) / 1000000.0,
+                          kind->name);
+
+  for (i = 0; i < 2; ++i)
+    {
+      if (kind->str_labels[i])
+        {
+          g_string_append_printf (out, " %s=%s", kind->str_labels[i],
+                                  event->str[i] ? event->str[i] : "(none)");
+        }
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (kind->num_labels); ++i)
+    {
+      if (kind->num_labels[i])
+        {
+          g_string_append_printf (out, " %s=%" G_GUINT32_FORMAT,
+                                  kind->num_labels[i], event->num[i]);
+        }
+    }
+
+  if (kind->text_label)
+    {
+      g_string_append_printf (out, " %s=`%s'",
+                              kind->text_label, event->text);
+    }
+
+  g_string_append_c (out, '\n');
+}
+
+
+/**
+ * wys_flight_dump:
+ *
+ * Format the events in the flight recorder, oldest first, one per
+ * line.  Each line starts with the event's time in seconds relative
+ * to now.
+ *
+ * Returns: (transfer full): The formatted events.
+ */
+gchar *
+wys_flight_dump (void)
+{
+  const gint64 now = g_get_monotonic_time ();
+  const guint64 first =
+    recorded > WYS_FLIGHT_EVENTS ? recorded - WYS_FLIGHT_EVENTS : 0;
+  GString *out;
+  guint64 i;
+
+  out = g_string_new (NULL);
+
+  if (first > 0)
+    {
+      g_string_append_printf (out, "(%" G_GUINT64_FORMAT
+                              " earlier events overwritten)\n", first);
+    }
+
+  for (i = first; i < recorded; ++i)
+    {
+      format_event (out, &ring[i % WYS_FLIGHT_EVENTS], now);
+    }
+
+  return g_string_free (out, FALSE);
+}
+
+
+/**
+ * wys_flight_log:
+ *
+ * Log the events in the flight recorder.
+ */
+void
+wys_flight_log (void)
+{
+  g_autofree gchar *dump = wys_flight_dump ();
+
+  g_message ("Flight recorder, %" G_GUINT64_FORMAT " events:\n%s",
+             MIN (recorded, (guint64)WYS_FLIGHT_EVENTS), dump);
+}
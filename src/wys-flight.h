@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#ifndef WYS_FLIGHT_H__
+#define WYS_FLIGHT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** How many events the flight recorder keeps */
+#define WYS_FLIGHT_EVENTS 1024
+
+/** The longest text recorded with an event, including the NUL.
+    Enough for PulseAudio's ALSA device names, which run long. */
+#define WYS_FLIGHT_TEXT_LEN 128
+
+/** A kind of flight recorder event: its name and the labels of the
+    fields it uses.  Fields with a NULL label are left out of the
+    dump. */
+typedef struct
+{
+  const gchar *name;
+  const gchar *str_labels[2];
+  const gchar *num_labels[3];
+  const gchar *text_label;
+} WysFlightKind;
+
+void   wys_flight_record (const WysFlightKind *kind,
+                          const gchar         *str0,
+                          const gchar         *str1,
+                          guint32              num0,
+                          guint32              num1,
+                          guint32              num2,
+                          const gchar         *text);
+gchar *wys_flight_dump   (void);
+void   wys_flight_log    (void);
+
+G_END_DECLS
+
+#endif /* WYS_FLIGHT_H__ */
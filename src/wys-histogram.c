@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-histogram.h"
+
+#include <string.h>
+
+/* Values below SUB have a bucket each; above that, each power of two
+   is split into SUB buckets */
+#define SUB_BITS  3
+#define SUB       (1 << SUB_BITS)
+#define N_BUCKETS ((32 - SUB_BITS + 1) * SUB)
+
+
+struct _WysHistogram
+{
+  guint64 counts[N_BUCKETS];
+  guint64 count;
+  guint64 sum;
+  guint32 min;
+  guint32 max;
+};
+
+
+static inline guint
+bucket_of (guint32 value)
+{
+  guint shift;
+
+  if (value < SUB)
+    {
+      return value;
+    }
+
+  shift = g_bit_storage (value) - 1 - SUB_BITS;
+  return (shift + 1) * SUB + ((value >> shift) & (SUB - 1));
+}
+
+
+/** The highest value that falls in the bucket */
+static inline guint32
+bucket_max (guint bucket)
+{
+  guint shift;
+  guint64 lower;
+
+  if (bucket < SUB)
+    {
+      return bucket;
+    }
+
+  shift = bucket / SUB - 1;
+  lower = (guint64)(SUB + bucket % SUB) << shift;
+  return (guint32)MIN (lower + ((guint64)1 << shift) - 1, G_MAXUINT32);
+}
+
+
+WysHistogram *
+wys_histogram_new (void)
+{
+  WysHistogram *self = g_new (WysHistogram, 1);
+
+  wys_histogram_reset (self);
+  return self;
+}
+
+
+void
+wys_histogram_free (WysHistogram *self)
+{
+  g_free (self);
+}
+
+
+void
+wys_histogram_reset (WysHistogram *self)
+{
+  memset (self->counts, 0, sizeof (self->counts));
+  self->count = 0;
+  self->sum = 0;
+  self->min = G_MAXUINT32;
+  self->max = 0;
+}
+
+
+void
+wys_histogram_record (WysHistogram *self,
+                      guint32       value)
+{
+  ++self->counts[bucket_of (value)];
+  ++self->count;
+  self->sum += value;
+  self->min = MIN (self->min, value);
+  self->max = MAX (self->max, value);
+}
+
+
+guint64
+wys_histogram_get_count (const WysHistogram *self)
+{
+  return self->count;
+}
+
+
+guint32
+wys_histogram_get_min (const WysHistogram *self)
+{
+  return self->count > 0 ? self->min : 0;
+}
+
+
+guint32
+wys_histogram_get_max (const WysHistogram *self)
+{
+  return self->max;
+}
+
+
+gdouble
+wys_histogram_get_mean (const WysHistogram *self)
+{
+  return self->count > 0 ? (gdouble)self->sum / self->count : 0.0;
+}
+
+
+/** The value at or below which @percentile percent of the recorded
+    values fall, rounded up to the top of its bucket */
+guint32
+wys_histogram_get_percentile (const WysHistogram *self,
+                              gdouble             percentile)
+{
+  guint64 rank, seen = 0;
+  guint i;
+
+  if (self->count == 0)
+    {
+      return 0;
+    }
+
+  rank = (guint64)(CLAMP (percentile, 0.0, 100.0) / 100.0
+                   * (gdouble)self->count + 0.5);
+  rank = CLAMP (rank, 1, self->count);
+
+  for (i = 0; i < N_BUCKETS; ++i)
+    {
+      seen += self->counts[i];
+      if (seen >= rank)
+        {
+          return CLAMP (bucket_max (i), self->min, self->max);
+        }
+    }
+
+  return self->max;
+}
+
+
+gchar *
+wys_histogram_to_string (const WysHistogram *self)
+{
+  return g_strdup_printf ("n=%" G_GUINT64_FORMAT
+                          " min=%" G_GUINT32_FORMAT
+                          " p50=%" G_GUINT32_FORMAT
+                          " p90=%" G_GUINT32_FORMAT
+                          " p99=%" G_GUINT32_FORMAT
+                          " max=%" G_GUINT32_FORMAT
+                          " mean=%.1f",
+                          self->count,
+                          wys_histogram_get_min (self),
+                          wys_histogram_get_percentile (self, 50.0),
+                          wys_histogram_get_percentile (self, 90.0),
+                          wys_histogram_get_percentile (self, 99.0),
+                          wys_histogram_get_max (self),
+                          wys_histogram_get_mean (self));
+}
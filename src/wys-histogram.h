@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_HISTOGRAM_H__
+#define WYS_HISTOGRAM_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** A histogram of unsigned 32-bit values in a fixed amount of
+    memory.  Values are counted in buckets that are exact below 8 and
+    split each power of two into 8 above that, so percentiles are
+    reported to within 12.5%. */
+typedef struct _WysHistogram WysHistogram;
+
+WysHistogram *wys_histogram_new            (void);
+void          wys_histogram_free           (WysHistogram       *self);
+void          wys_histogram_reset          (WysHistogram       *self);
+void          wys_histogram_record         (WysHistogram       *self,
+                                            guint32             value);
+guint64       wys_histogram_get_count      (const WysHistogram *self);
+guint32       wys_histogram_get_min        (const WysHistogram *self);
+guint32       wys_histogram_get_max        (const WysHistogram *self);
+gdouble       wys_histogram_get_mean       (const WysHistogram *self);
+guint32       wys_histogram_get_percentile (const WysHistogram *self,
+                                            gdouble             percentile);
+gchar        *wys_histogram_to_string      (const WysHistogram *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WysHistogram, wys_histogram_free)
+
+G_END_DECLS
+
+#endif /* WYS_HISTOGRAM_H__ */
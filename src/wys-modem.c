@@ -25,24 +25,66 @@
 
 #include "wys-modem.h"
 #include "wys-direction.h"
+#include "wys-trace.h"
+#include "wys-probes.h"
 #include "util.h"
 #include "enum-types.h"
 
 #include <glib/gi18n.h>
 
-static const gchar * const WYS_MODEM_HAS_AUDIO[] =
-  {
-   [WYS_DIRECTION_FROM_NETWORK] = "wys-has-audio-from-network",
-   [WYS_DIRECTION_TO_NETWORK]   = "wys-has-audio-to-network"
-  };
+/** How many call state transitions each modem remembers */
+#define TRANSITION_HISTORY 32
+
+/** What we know of each call */
+struct call
+{
+  gchar *path;
+  /** A number for the call, unique for the life of the modem, to
+      tie transitions to it */
+  guint id;
+  /** The call's proxy, or NULL when tracking calls in lean mode */
+  MMCall *proxy;
+  /** In lean mode, our subscriptions to the call's signals */
+  GDBusConnection *connection;
+  guint state_changed_id;
+  guint properties_changed_id;
+  /** The call's last known state */
+  MMCallState state;
+  /** Monotonic times at which the call was added and last changed
+      state */
+  gint64 added;
+  gint64 changed;
+};
+
+/** A change in a call's state.  A call is added in the unknown
+    state and goes back to it when it is removed. */
+struct transition
+{
+  gint64 time;
+  guint call_id;
+  MMCallState old_state;
+  MMCallState new_state;
+};
 
 struct _WysModem
 {
   GObject parent_instance;
   /** ModemManager voice proxy */
   MMModemVoice *voice;
-  /** Map of D-Bus object paths to MMCall objects */
-  GHashTable *calls;
+  /** Whether to track calls through plain D-Bus signal
+      subscriptions instead of MMCall proxies */
+  gboolean lean;
+  /** The calls, as a plain array of struct call; there are only
+      ever a few, so we look them up by path with a linear search */
+  GArray *calls;
+  guint next_call_id;
+  /** Ring of the most recent call state transitions, and how many
+      there have been */
+  struct transition transitions[TRANSITION_HISTORY];
+  guint64 n_transitions;
+  /** Set of the object paths of added calls whose proxies we are
+      still creating */
+  GHashTable *pending_calls;
   /** How many calls have audio, in each direction */
   guint audio_count[2];
 };
@@ -52,6 +94,7 @@ G_DEFINE_TYPE(WysModem, wys_modem, G_TYPE_OBJECT)
 enum {
   PROP_0,
   PROP_VOICE,
+  PROP_LEAN,
   PROP_LAST_PROP,
 };
 static GParamSpec *props[PROP_LAST_PROP];
@@ -98,69 +141,168 @@ update_audio_count (WysModem     *self,
       g_debug ("Modem `%s' audio %s now present",
                mm_modem_voice_get_path (self->voice),
                wys_direction_get_description (direction));
+      wys_trace_instant ("mm", "audio_present");
+      WYS_PROBE1 (audio_present, direction);
       g_signal_emit_by_name (self, "audio-present", direction);
     }
   else if (self->audio_count[direction] == 0 && old_count > 0)
     {
       g_debug ("Modem `%s' audio now absent",
                mm_modem_voice_get_path (self->voice));
+      wys_trace_instant ("mm", "audio_absent");
+      WYS_PROBE1 (audio_absent, direction);
       g_signal_emit_by_name (self, "audio-absent", direction);
     }
 }
 
 
-static gboolean
-get_call_has_audio (MMCall       *mm_call,
-                    WysDirection  direction)
+static struct call *
+find_call (WysModem    *self,
+           const gchar *path)
 {
-  gpointer data;
+  guint i;
 
-  data = g_object_get_data (G_OBJECT (mm_call),
-                            WYS_MODEM_HAS_AUDIO[direction]);
+  for (i = 0; i < self->calls->len; ++i)
+    {
+      struct call *call = &g_array_index (self->calls, struct call, i);
 
-  return (gboolean)(GPOINTER_TO_UINT (data));
+      if (strcmp (call->path, path) == 0)
+        {
+          return call;
+        }
+    }
+
+  return NULL;
+}
+
+
+/** Add a record for a new call.  The record is only valid until the
+    next call is added or removed. */
+static struct call *
+new_call (WysModem    *self,
+          const gchar *path)
+{
+  struct call call = { NULL, };
+
+  call.path = g_strdup (path);
+  call.id = ++self->next_call_id;
+  call.state = MM_CALL_STATE_UNKNOWN;
+  call.added = call.changed = g_get_monotonic_time ();
+  g_array_append_val (self->calls, call);
+
+  return &g_array_index (self->calls, struct call, self->calls->len - 1);
 }
 
 
 static void
-set_call_has_audio (MMCall       *mm_call,
-                    WysDirection  direction,
-                    gboolean      has_audio)
+remove_call (WysModem    *self,
+             const gchar *path)
+{
+  guint i;
+
+  for (i = 0; i < self->calls->len; ++i)
+    {
+      if (strcmp (g_array_index (self->calls, struct call, i).path,
+                  path) == 0)
+        {
+          g_array_remove_index_fast (self->calls, i);
+          return;
+        }
+    }
+}
+
+
+static void
+call_clear (struct call *call)
 {
-  g_object_set_data (G_OBJECT (mm_call),
-                     WYS_MODEM_HAS_AUDIO[direction],
-                     GUINT_TO_POINTER ((guint)has_audio));
+  if (call->connection)
+    {
+      g_dbus_connection_signal_unsubscribe (call->connection,
+                                            call->state_changed_id);
+      g_dbus_connection_signal_unsubscribe (call->connection,
+                                            call->properties_changed_id);
+    }
+
+  g_clear_object (&call->proxy);
+  g_free (call->path);
 }
 
 
+/** Move a call to a new state, updating the audio count in each
+    direction that the call gains or loses audio in.  Setting
+    MM_CALL_STATE_UNKNOWN drops any audio the call had. */
 static void
-update_direction_state (WysModem     *self,
-                        MMCall       *mm_call,
-                        const gchar  *path,
-                        WysDirection  direction,
-                        MMCallState   old_state,
-                        MMCallState   new_state)
+update_call_state (WysModem    *self,
+                   struct call *call,
+                   MMCallState  state)
 {
-  gboolean had_audio  = call_state_has_audio (direction, old_state);
-  gboolean have_audio = call_state_has_audio (direction, new_state);
+  const gchar *path = call->path;
+  struct transition *transition;
+  WysDirection direction;
 
-  if (!had_audio && have_audio)
+  if (state == call->state)
     {
-      g_debug ("Call `%s' gained audio %s", path,
-               wys_direction_get_description (direction));
-      update_audio_count (self, direction, +1);
+      return;
     }
-  else if (had_audio && !have_audio)
+
+  call->changed = g_get_monotonic_time ();
+
+  transition =
+    &self->transitions[self->n_transitions++ % TRANSITION_HISTORY];
+  transition->time = call->changed;
+  transition->call_id = call->id;
+  transition->old_state = call->state;
+  transition->new_state = state;
+
+  for (direction = WYS_DIRECTION_FROM_NETWORK;
+       direction <= WYS_DIRECTION_TO_NETWORK;
+       ++direction)
     {
-      g_debug ("Call `%s' lost audio %s", path,
-               wys_direction_get_description (direction));
-      update_audio_count (self, direction, -1);
+      const gboolean had_audio = call_state_has_audio (direction, call->state);
+      const gboolean have_audio = call_state_has_audio (direction, state);
+
+      if (!had_audio && have_audio)
+        {
+          g_debug ("Call `%s' gained audio %s", path,
+                   wys_direction_get_description (direction));
+          update_audio_count (self, direction, +1);
+        }
+      else if (had_audio && !have_audio)
+        {
+          g_debug ("Call `%s' lost audio %s", path,
+                   wys_direction_get_description (direction));
+          update_audio_count (self, direction, -1);
+        }
     }
 
-  if (had_audio != have_audio)
+  call->state = state;
+}
+
+
+static void
+call_state_changed (WysModem    *self,
+                    const gchar *path,
+                    MMCallState  state)
+{
+  struct call *call;
+
+  call = find_call (self, path);
+  if (!call || call->state == state)
     {
-      set_call_has_audio (mm_call, direction, have_audio);
+      return;
     }
+
+  g_debug ("Call `%s' state changed, new: %i, old: %i",
+           path, (int)state, (int)call->state);
+  wys_trace_instant ("mm", "call_state_changed");
+  WYS_PROBE3 (call_state_changed, path, call->state, state);
+
+  // When calls are put on hold or swapped, one call may go
+  // non-audio before another goes audio; the audio count briefly
+  // reaching zero is smoothed over by the hold grace period in
+  // main.c
+
+  update_call_state (self, call, state);
 }
 
 
@@ -171,64 +313,151 @@ call_state_changed_cb (MmGdbusCall       *mm_gdbus_call,
                        MMCallStateReason  reason,
                        WysModem          *self)
 {
-  MMCall *mm_call = MM_CALL (mm_gdbus_call);
-  const gchar * path = mm_call_get_path (mm_call);
+  call_state_changed (self, mm_call_get_path (MM_CALL (mm_gdbus_call)),
+                      new_state);
+}
 
-  g_debug ("Call `%s' state changed, new: %i, old: %i",
-           path, (int)new_state, (int)old_state);
 
-  // FIXME: deal with calls being put on hold (one call goes
-  // non-audio, another call goes audio after)
+static void
+add_call (WysModem *self,
+          MMCall   *mm_call)
+{
+  struct call *call;
+
+  call = new_call (self, mm_call_get_path (mm_call));
+  call->proxy = g_object_ref (mm_call);
 
-  update_direction_state (self, mm_call, path,
-                          WYS_DIRECTION_FROM_NETWORK,
-                          old_state, new_state);
-  update_direction_state (self, mm_call, path,
-                          WYS_DIRECTION_TO_NETWORK,
-                          old_state, new_state);
+  g_signal_connect (MM_GDBUS_CALL (mm_call), "state-changed",
+                    G_CALLBACK (call_state_changed_cb),
+                    self);
+
+  update_call_state (self, call, mm_call_get_state (mm_call));
+
+  g_debug ("Call `%s' added, state: %i", call->path, (int)call->state);
 }
 
 
 static void
-init_call_direction (WysModem     *self,
-                     MMCall       *mm_call,
-                     MMCallState   state,
-                     WysDirection  direction)
+lean_state_changed_cb (GDBusConnection *connection,
+                       const gchar     *sender_name,
+                       const gchar     *object_path,
+                       const gchar     *interface_name,
+                       const gchar     *signal_name,
+                       GVariant        *parameters,
+                       WysModem        *self)
 {
-  gboolean has_audio = call_state_has_audio (direction, state);
+  gint32 old_state, new_state;
+  guint32 reason;
 
-  set_call_has_audio (mm_call, direction, has_audio);
+  g_variant_get (parameters, "(iiu)", &old_state, &new_state, &reason);
+  call_state_changed (self, object_path, (MMCallState)new_state);
+}
 
-  if (has_audio)
+
+static void
+lean_properties_changed_cb (GDBusConnection *connection,
+                            const gchar     *sender_name,
+                            const gchar     *object_path,
+                            const gchar     *interface_name,
+                            const gchar     *signal_name,
+                            GVariant        *parameters,
+                            WysModem        *self)
+{
+  GVariant *changed;
+  gint32 state;
+
+  changed = g_variant_get_child_value (parameters, 1);
+  if (g_variant_lookup (changed, "State", "i", &state))
     {
-      update_audio_count (self, direction, +1);
+      call_state_changed (self, object_path, (MMCallState)state);
     }
+  g_variant_unref (changed);
 }
 
 
-static void
-add_call (WysModem *self,
-          MMCall   *mm_call)
+struct lean_get_state_data
 {
-  MmGdbusCall *mm_gdbus_call = MM_GDBUS_CALL (mm_call);
+  WysModem *self;
   gchar *path;
-  MMCallState state;
+};
 
-  g_object_ref (mm_call);
-  path = mm_call_dup_path (mm_call);
-  g_hash_table_insert (self->calls, path, mm_call);
 
-  g_signal_connect (mm_gdbus_call, "state-changed",
-                    G_CALLBACK (call_state_changed_cb),
-                    self);
+static void
+lean_get_state_cb (GDBusConnection            *connection,
+                   GAsyncResult               *res,
+                   struct lean_get_state_data *data)
+{
+  GVariant *reply, *value;
+  GError *error = NULL;
+
+  wys_trace_async_end ("mm", "get_call_state", WYS_TRACE_ID (data));
+
+  reply = g_dbus_connection_call_finish (connection, res, &error);
+  if (!reply)
+    {
+      g_warning ("Error getting the state of call `%s': %s",
+                 data->path, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      /* Any state change signal that arrived first is older than
+         this reply */
+      g_variant_get (reply, "(v)", &value);
+      call_state_changed (data->self, data->path,
+                          (MMCallState)g_variant_get_int32 (value));
+      g_variant_unref (value);
+      g_variant_unref (reply);
+    }
 
-  state = mm_call_get_state (mm_call);
-  init_call_direction (self, mm_call, state,
-                       WYS_DIRECTION_FROM_NETWORK);
-  init_call_direction (self, mm_call, state,
-                       WYS_DIRECTION_TO_NETWORK);
+  g_object_unref (data->self);
+  g_free (data->path);
+  g_free (data);
+}
+
+
+/** Track a call with subscriptions to its StateChanged and
+    PropertiesChanged signals and a single query of its state,
+    without creating a proxy that loads all of its properties */
+static void
+add_lean_call (WysModem    *self,
+               const gchar *path)
+{
+  GDBusConnection *connection =
+    g_dbus_proxy_get_connection (G_DBUS_PROXY (self->voice));
+  struct lean_get_state_data *data;
+  struct call *call;
+
+  call = new_call (self, path);
+  call->connection = connection;
+  call->state_changed_id =
+    g_dbus_connection_signal_subscribe
+    (connection, MM_DBUS_SERVICE, MM_DBUS_INTERFACE_CALL,
+     "StateChanged", path, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+     (GDBusSignalCallback)lean_state_changed_cb, self, NULL);
+  call->properties_changed_id =
+    g_dbus_connection_signal_subscribe
+    (connection, MM_DBUS_SERVICE, "org.freedesktop.DBus.Properties",
+     "PropertiesChanged", path, MM_DBUS_INTERFACE_CALL,
+     G_DBUS_SIGNAL_FLAGS_NONE,
+     (GDBusSignalCallback)lean_properties_changed_cb, self, NULL);
+
+  data = g_new (struct lean_get_state_data, 1);
+  data->self = g_object_ref (self);
+  data->path = g_strdup (path);
 
-  g_debug ("Call `%s' added, state: %i", path, (int)state);
+  wys_trace_async_begin ("mm", "get_call_state", WYS_TRACE_ID (data));
+  g_dbus_connection_call (connection, MM_DBUS_SERVICE, path,
+                          "org.freedesktop.DBus.Properties", "Get",
+                          g_variant_new ("(ss)",
+                                         MM_DBUS_INTERFACE_CALL,
+                                         "State"),
+                          G_VARIANT_TYPE ("(v)"),
+                          G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          (GAsyncReadyCallback)lean_get_state_cb,
+                          data);
+
+  g_debug ("Call `%s' added", path);
 }
 
 
@@ -240,61 +469,50 @@ struct WysModemCallAddedData
 
 
 static void
-call_added_list_calls_cb (MMModemVoice                 *voice,
-                          GAsyncResult                 *res,
-                          struct WysModemCallAddedData *data)
+call_added_new_call_cb (GObject                      *source,
+                        GAsyncResult                 *res,
+                        struct WysModemCallAddedData *data)
 {
-  GList *calls;
+  WysModem *self = data->self;
+  GObject *call;
   GError *error = NULL;
+  gboolean pending;
 
-  calls = mm_modem_voice_list_calls_finish (voice, res, &error);
-  if (!calls)
+  wys_trace_async_end ("mm", "call_new", WYS_TRACE_ID (data));
+
+  pending = g_hash_table_remove (self->pending_calls, data->path);
+
+  call = g_async_initable_new_finish (G_ASYNC_INITABLE (source),
+                                      res, &error);
+  if (!call)
     {
-      if (error)
-        {
-          g_warning ("Error listing calls on MMModemVoice"
-                     " after call-added signal: %s",
-                     error->message);
-          g_error_free (error);
-        }
-      else
-        {
-          g_warning ("No calls on MMModemVoice"
-                     " after call-added signal");
-        }
+      g_warning ("Error creating proxy for call `%s'"
+                 " after call-added signal: %s",
+                 data->path, error->message);
+      g_error_free (error);
+    }
+  else if (!pending)
+    {
+      g_debug ("Call `%s' went away before its proxy was ready",
+               data->path);
     }
   else
     {
-      GList *node;
-      MMCall *call;
-      gboolean found = FALSE;
-
-      for (node = calls; node; node = node->next)
-        {
-          call = MM_CALL (node->data);
-
-          if (g_strcmp0 (mm_call_get_path (call), data->path) == 0)
-            {
-              add_call (data->self, call);
-              found = TRUE;
-            }
-        }
-
-      if (!found)
-        {
-          g_warning ("Could not find new call `%s' in call list"
-                     " on MMModemVoice after call-added signal",
-                     data->path);
-        }
-
-      g_list_free_full (calls, g_object_unref);
+      add_call (self, MM_CALL (call));
     }
 
+  g_clear_object (&call);
+  g_object_unref (self);
   g_free (data->path);
   g_free (data);
 }
 
 
+/** Create the new call's proxy straight from the object path in
+    the signal, rather than listing all of the modem's calls, so
+    that adding a call costs one round trip however many calls
+    there are.  This is how libmm-glib creates its own MMCall
+    objects. */
 static void
 call_added_cb (MMModemVoice  *voice,
                gchar         *path,
@@ -302,37 +520,42 @@ call_added_cb (MMModemVoice  *voice,
 {
   struct WysModemCallAddedData *data;
 
-  if (g_hash_table_contains (self->calls, path))
+  wys_trace_instant ("mm", "call_added");
+  WYS_PROBE1 (call_added, path);
+
+  if (find_call (self, path)
+      || g_hash_table_contains (self->pending_calls, path))
     {
       g_warning ("Received call-added signal for"
                  " existing call object path `%s'", path);
       return;
     }
 
+  if (self->lean)
+    {
+      add_lean_call (self, path);
+      return;
+    }
+
+  g_hash_table_add (self->pending_calls, g_strdup (path));
+
   data = g_new0 (struct WysModemCallAddedData, 1);
-  data->self = self;
+  data->self = g_object_ref (self);
   data->path = g_strdup (path);
 
-  mm_modem_voice_list_calls
-    (voice,
+  wys_trace_async_begin ("mm", "call_new", WYS_TRACE_ID (data));
+  g_async_initable_new_async
+    (MM_TYPE_CALL,
+     G_PRIORITY_DEFAULT,
      NULL,
-     (GAsyncReadyCallback) call_added_list_calls_cb,
-     data);
-}
-
-
-static void
-clear_call_direction (WysModem     *self,
-                      MMCall       *mm_call,
-                      WysDirection  direction)
-{
-  gboolean has_audio =
-    get_call_has_audio (mm_call, direction);
-
-  if (has_audio)
-    {
-      update_audio_count (self, direction, -1);
-    }
+     (GAsyncReadyCallback) call_added_new_call_cb,
+     data,
+     "g-flags",          G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+     "g-name",           MM_DBUS_SERVICE,
+     "g-connection",     g_dbus_proxy_get_connection (G_DBUS_PROXY (voice)),
+     "g-object-path",    path,
+     "g-interface-name", MM_DBUS_INTERFACE_CALL,
+     NULL);
 }
 
 
@@ -341,23 +564,28 @@ call_deleted_cb (MMModemVoice *voice,
                  const gchar  *path,
                  WysModem     *self)
 {
-  MMCall *mm_call;
+  struct call *call;
 
   g_debug ("Removing call `%s'", path);
+  wys_trace_instant ("mm", "call_deleted");
+  WYS_PROBE1 (call_deleted, path);
 
-  mm_call = g_hash_table_lookup (self->calls, path);
-  if (!mm_call)
+  if (g_hash_table_remove (self->pending_calls, path))
+    {
+      g_debug ("Call `%s' removed before it was added", path);
+      return;
+    }
+
+  call = find_call (self, path);
+  if (!call)
     {
       g_warning ("Could not find removed call `%s'", path);
       return;
     }
 
-  clear_call_direction (self, mm_call,
-                        WYS_DIRECTION_FROM_NETWORK);
-  clear_call_direction (self, mm_call,
-                        WYS_DIRECTION_TO_NETWORK);
+  update_call_state (self, call, MM_CALL_STATE_UNKNOWN);
 
-  g_hash_table_remove (self->calls, path);
+  remove_call (self, path);
 
   g_debug ("Call `%s' removed", path);
 }
@@ -385,7 +613,18 @@ list_calls_cb (MMModemVoice  *voice,
 
   for (node = calls; node; node = node->next)
     {
-      add_call (self, MM_CALL (node->data));
+      MMCall *call = MM_CALL (node->data);
+      const gchar *path = mm_call_get_path (call);
+
+      /* A call-added signal may have beaten the list; the list's
+         proxy is as good as the one still being created */
+      if (find_call (self, path))
+        {
+          continue;
+        }
+      g_hash_table_remove (self->pending_calls, path);
+
+      add_call (self, call);
     }
 
   g_list_free_full (calls, g_object_unref);
@@ -405,6 +644,10 @@ set_property (GObject      *object,
     g_set_object (&self->voice, g_value_get_object(value));
     break;
 
+  case PROP_LEAN:
+    self->lean = g_value_get_boolean (value);
+    break;
+
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
@@ -425,11 +668,25 @@ constructed (GObject *object)
   g_signal_connect (gdbus_voice, "call-deleted",
                     G_CALLBACK (call_deleted_cb), self);
 
-  mm_modem_voice_list_calls
-    (self->voice,
-     NULL,
-     (GAsyncReadyCallback) list_calls_cb,
-     self);
+  if (self->lean)
+    {
+      gchar **paths, **path;
+
+      paths = mm_gdbus_modem_voice_dup_calls (gdbus_voice);
+      for (path = paths; path && *path; ++path)
+        {
+          add_lean_call (self, *path);
+        }
+      g_strfreev (paths);
+    }
+  else
+    {
+      mm_modem_voice_list_calls
+        (self->voice,
+         NULL,
+         (GAsyncReadyCallback) list_calls_cb,
+         self);
+    }
 
   parent_class->constructed (object);
 }
@@ -441,9 +698,9 @@ dispose (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysModem *self = WYS_MODEM (object);
 
-  if (g_hash_table_size (self->calls) > 0)
+  if (self->calls->len > 0)
     {
-      g_hash_table_remove_all (self->calls);
+      g_array_remove_range (self->calls, 0, self->calls->len);
       if (self->audio_count[WYS_DIRECTION_FROM_NETWORK] > 0 ||
           self->audio_count[WYS_DIRECTION_TO_NETWORK] > 0)
         {
@@ -453,6 +710,7 @@ dispose (GObject *object)
         }
     }
 
+  g_hash_table_remove_all (self->pending_calls);
   g_clear_object (&self->voice);
 
   parent_class->dispose (object);
@@ -465,7 +723,8 @@ finalize (GObject *object)
   GObjectClass *parent_class = g_type_class_peek (G_TYPE_OBJECT);
   WysModem *self = WYS_MODEM (object);
 
-  g_hash_table_unref (self->calls);
+  g_hash_table_unref (self->pending_calls);
+  g_array_unref (self->calls);
 
   parent_class->finalize (object);
 }
@@ -487,6 +746,13 @@ wys_modem_class_init (WysModemClass *klass)
                          MM_TYPE_MODEM_VOICE,
                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
 
+  props[PROP_LEAN] =
+    g_param_spec_boolean ("lean",
+                          _("Lean"),
+                          _("Whether to track calls with D-Bus signal subscriptions instead of call proxies"),
+                          FALSE,
+                          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
   g_object_class_install_properties (object_class, PROP_LAST_PROP, props);
 
 
@@ -528,15 +794,98 @@ wys_modem_class_init (WysModemClass *klass)
 static void
 wys_modem_init (WysModem *self)
 {
-  self->calls = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       g_free, g_object_unref);
+  self->calls = g_array_new (FALSE, FALSE, sizeof (struct call));
+  g_array_set_clear_func (self->calls, (GDestroyNotify)call_clear);
+  self->pending_calls = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
 }
 
 
 WysModem *
-wys_modem_new (MMModemVoice *voice)
+wys_modem_new (MMModemVoice *voice,
+               gboolean      lean)
 {
   return g_object_new (WYS_TYPE_MODEM,
                        "voice", voice,
+                       "lean", lean,
                        NULL);
 }
+
+
+/** Whether any of the modem's calls currently has audio in
+    the given direction */
+gboolean
+wys_modem_get_audio (WysModem     *self,
+                     WysDirection  direction)
+{
+  g_return_val_if_fail (WYS_IS_MODEM (self), FALSE);
+
+  return self->audio_count[direction] > 0;
+}
+
+
+/**
+ * wys_modem_dump_calls:
+ * @self: A #WysModem.
+ *
+ * Describe the modem's current calls and its most recent call state
+ * transitions, oldest first, with times in seconds before now.
+ *
+ * Returns: (transfer full): The description.
+ */
+gchar *
+wys_modem_dump_calls (WysModem *self)
+{
+  const gint64 now = g_get_monotonic_time ();
+  GString *out;
+  guint64 i;
+
+  g_return_val_if_fail (WYS_IS_MODEM (self), NULL);
+
+  out = g_string_new (NULL);
+  g_string_append_printf (out, "Modem `%s', %u calls:\n",
+                          mm_modem_voice_get_path (self->voice),
+                          self->calls->len);
+
+  for (i = 0; i < self->calls->len; ++i)
+    {
+      const struct call *call =
+        &g_array_index (self->calls, struct call, i);
+
+      g_string_append_printf (out,
+                              "  call %u `%s' %s, added %.3fs ago,"
+                              " changed %.3fs ago\n",
+                              call->id, call->path,
+                              mm_call_state_get_string (call->state),
+                              (now - call->added) / 1000000.0,
+                              (now - call->changed) / 1000000.0);
+    }
+
+  i = self->n_transitions > TRANSITION_HISTORY
+    ? self->n_transitions - TRANSITION_HISTORY : 0;
+  for (; i < self->n_transitions; ++i)
+    {
+      const struct transition *transition =
+        &self->transitions[i % TRANSITION_HISTORY];
+
+      g_string_append_printf (out, "  %12.6fs call %u %s -> %s\n",
+                              (transition->time - now) / 1000000.0,
+                              transition->call_id,
+                              mm_call_state_get_string (transition->old_state),
+                              mm_call_state_get_string (transition->new_state));
+    }
+
+  return g_string_free (out, FALSE);
+}
+
+
+void
+wys_modem_log_calls (WysModem *self)
+{
+  g_autofree gchar *dump = NULL;
+
+  g_return_if_fail (WYS_IS_MODEM (self));
+
+  dump = wys_modem_dump_calls (self);
+  g_message ("%s", dump);
+}
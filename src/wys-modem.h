@@ -25,6 +25,8 @@
 #ifndef WYS_MODEM_H__
 #define WYS_MODEM_H__
 
+#include "wys-direction.h"
+
 #include <libmm-glib.h>
 
 G_BEGIN_DECLS
@@ -33,7 +35,12 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (WysModem, wys_modem, WYS, MODEM, GObject);
 
-WysModem *wys_modem_new (MMModemVoice *voice);
+WysModem *wys_modem_new        (MMModemVoice *voice,
+                                gboolean      lean);
+gboolean  wys_modem_get_audio  (WysModem     *self,
+                                WysDirection  direction);
+gchar    *wys_modem_dump_calls (WysModem     *self);
+void      wys_modem_log_calls  (WysModem     *self);
 
 G_END_DECLS
 
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#ifndef WYS_PROBES_H__
+#define WYS_PROBES_H__
+
+#include "config.h"
+
+/** USDT probe points, for perf and bpftrace to attach to.  Without
+    the usdt build option they compile to nothing.  Even with it, an
+    unattached probe is a single nop, but its arguments are still
+    evaluated, so they must be cheap. */
+#ifdef WYS_USDT
+
+#include <sys/sdt.h>
+
+#define WYS_PROBE(name)                 DTRACE_PROBE (wys, name)
+#define WYS_PROBE1(name, a)             DTRACE_PROBE1 (wys, name, a)
+#define WYS_PROBE2(name, a, b)          DTRACE_PROBE2 (wys, name, a, b)
+#define WYS_PROBE3(name, a, b, c)       DTRACE_PROBE3 (wys, name, a, b, c)
+
+#else
+
+#define WYS_PROBE(name)                 do {} while (0)
+#define WYS_PROBE1(name, a)             do {} while (0)
+#define WYS_PROBE2(name, a, b)          do {} while (0)
+#define WYS_PROBE3(name, a, b, c)       do {} while (0)
+
+#endif
+
+#endif /* WYS_PROBES_H__ */
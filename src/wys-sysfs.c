@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+
+#include "wys-sysfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define SOUND_CLASS_DIR "/sys/class/sound"
+#define ASOUND_CARDS    "/proc/asound/cards"
+
+
+/** Whether @path is @dir or lies below it */
+static gboolean
+path_is_under (const gchar *path,
+               const gchar *dir)
+{
+  const gsize len = strlen (dir);
+
+  return strncmp (path, dir, len) == 0
+    && (path[len] == '\0' || path[len] == '/');
+}
+
+
+/** Find the number of the ALSA card whose device is @device or one
+    of its descendants, or -1 if there is none */
+static gint
+find_card_number (const gchar *device)
+{
+  GDir *dir;
+  const gchar *name;
+  gint number = -1;
+  GError *error = NULL;
+
+  dir = g_dir_open (SOUND_CLASS_DIR, 0, &error);
+  if (!dir)
+    {
+      g_warning ("Error opening `%s': %s",
+                 SOUND_CLASS_DIR, error->message);
+      g_error_free (error);
+      return -1;
+    }
+
+  while (number == -1 && (name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *link = NULL;
+      char *card_device;
+      guint64 card;
+
+      if (!g_str_has_prefix (name, "card")
+          || !g_ascii_string_to_unsigned (name + 4, 10, 0, G_MAXINT,
+                                          &card, NULL))
+        {
+          continue;
+        }
+
+      link = g_build_filename (SOUND_CLASS_DIR, name, "device", NULL);
+      card_device = realpath (link, NULL);
+      if (!card_device)
+        {
+          continue;
+        }
+
+      if (path_is_under (card_device, device))
+        {
+          number = (gint)card;
+        }
+      free (card_device);
+    }
+
+  g_dir_close (dir);
+  return number;
+}
+
+
+/** Look up the name of ALSA card @number, as PulseAudio gives it in
+    the "alsa.card_name" property.  Each card's first line in
+    /proc/asound/cards reads "N [ID]: DRIVER - NAME". */
+static gchar *
+read_card_name (gint number)
+{
+  g_autofree gchar *contents = NULL;
+  gchar **lines, **line;
+  gchar *name = NULL;
+  GError *error = NULL;
+
+  if (!g_file_get_contents (ASOUND_CARDS, &contents, NULL, &error))
+    {
+      g_warning ("Error reading `%s': %s",
+                 ASOUND_CARDS, error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (line = lines; *line && !name; ++line)
+    {
+      const gchar *sep;
+      gint card;
+
+      if (sscanf (*line, " %d [", &card) != 1 || card != number)
+        {
+          continue;
+        }
+
+      sep = strstr (*line, "]: ");
+      if (sep)
+        {
+          sep = strstr (sep, " - ");
+        }
+      if (sep)
+        {
+          name = g_strstrip (g_strdup (sep + 3));
+        }
+    }
+  g_strfreev (lines);
+
+  return name;
+}
+
+
+/** Find the ALSA card that belongs to a modem's physical device, as
+    given by ModemManager's Device property.  USB modems usually
+    present their audio on another interface of the same USB device,
+    so if @device is an interface and has no card of its own, the
+    cards under its parent device are considered too.  Returns the
+    card's name or NULL if there is none. */
+gchar *
+wys_sysfs_find_alsa_card (const gchar *device)
+{
+  char *path;
+  gint number;
+  gchar *name = NULL;
+
+  if (!device || !g_str_has_prefix (device, "/sys/"))
+    {
+      return NULL;
+    }
+
+  path = realpath (device, NULL);
+  if (!path)
+    {
+      g_debug ("Modem device `%s' not found in sysfs", device);
+      return NULL;
+    }
+
+  number = find_card_number (path);
+  if (number == -1)
+    {
+      g_autofree gchar *base = g_path_get_basename (path);
+
+      if (strchr (base, ':'))
+        {
+          g_autofree gchar *parent = g_path_get_dirname (path);
+          number = find_card_number (parent);
+        }
+    }
+
+  if (number != -1)
+    {
+      name = read_card_name (number);
+      g_debug ("Modem device `%s' has ALSA card %d `%s'",
+               device, number, name ? name : "(unknown)");
+    }
+
+  free (path);
+  return name;
+}
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+
+#include "wys-trace.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+/** One trace event.  Category and name must be static strings so
+    that recording an event never allocates. */
+struct trace_event
+{
+  gint64 ts;
+  gint64 dur;
+  guint64 id;
+  const gchar *category;
+  const gchar *name;
+  gchar phase;
+};
+
+
+/** The preallocated event buffer, how many events it holds and how
+    many didn't fit since the last flush */
+static struct trace_event *events = NULL;
+static guint capacity = 0;
+static guint n_events = 0;
+static guint dropped = 0;
+
+/** The file the last flush wrote, how many events and drops it
+    holds, and the length of the closing part of its JSON, which the
+    next flush writes over */
+static gchar *flushed_file = NULL;
+static guint64 flushed_events = 0;
+static guint64 flushed_dropped = 0;
+static gsize footer_len = 0;
+
+static GPollFunc poll_func = NULL;
+
+
+static inline void
+record (gchar        phase,
+        const gchar *category,
+        const gchar *name,
+        guint64      id,
+        gint64       ts,
+        gint64       dur)
+{
+  struct trace_event *event;
+
+  if (G_LIKELY (!events))
+    {
+      return;
+    }
+
+  if (n_events == capacity)
+    {
+      ++dropped;
+      return;
+    }
+
+  event = &events[n_events++];
+  event->ts = ts;
+  event->dur = dur;
+  event->id = id;
+  event->category = category;
+  event->name = name;
+  event->phase = phase;
+}
+
+
+/** Record each main loop poll, so that the gaps between them show
+    the time spent dispatching */
+static gint
+trace_poll (GPollFD *fds,
+            guint    nfds,
+            gint     timeout)
+{
+  const gint64 start = g_get_monotonic_time ();
+  gint ret;
+
+  ret = poll_func (fds, nfds, timeout);
+  record ('X', "mainloop", "poll", 0,
+          start, g_get_monotonic_time () - start);
+
+  return ret;
+}
+
+
+/**
+ * wys_trace_start:
+ * @n: The number of events to make room for.
+ *
+ * Start recording trace events into a buffer allocated up front.
+ * Events that don't fit are counted and dropped until the next
+ * flush.
+ *
+ * Returns: %FALSE if tracing was already started.
+ */
+gboolean
+wys_trace_start (guint n)
+{
+  if (events)
+    {
+      return FALSE;
+    }
+
+  capacity = MAX (n, 1);
+  events = g_new0 (struct trace_event, capacity);
+  n_events = dropped = 0;
+
+  poll_func = g_main_context_get_poll_func (NULL);
+  g_main_context_set_poll_func (NULL, trace_poll);
+
+  return TRUE;
+}
+
+
+void
+wys_trace_stop (void)
+{
+  if (!events)
+    {
+      return;
+    }
+
+  g_main_context_set_poll_func (NULL, poll_func);
+  g_clear_pointer (&events, g_free);
+  capacity = n_events = dropped = 0;
+
+  g_clear_pointer (&flushed_file, g_free);
+  flushed_events = flushed_dropped = 0;
+  footer_len = 0;
+}
+
+
+void
+wys_trace_instant (const gchar *category,
+                   const gchar *name)
+{
+  record ('i', category, name, 0, g_get_monotonic_time (), 0);
+}
+
+
+void
+wys_trace_async_begin (const gchar *category,
+                       const gchar *name,
+                       guint64      id)
+{
+  record ('b', category, name, id, g_get_monotonic_time (), 0);
+}
+
+
+void
+wys_trace_async_end (const gchar *category,
+                     const gchar *name,
+                     guint64      id)
+{
+  record ('e', category, name, id, g_get_monotonic_time (), 0);
+}
+
+
+void
+wys_trace_complete (const gchar *category,
+                    const gchar *name,
+                    gint64       start,
+                    gint64       end)
+{
+  record ('X', category, name, 0, start, end - start);
+}
+
+
+static gboolean
+set_errno_error (GError      **error,
+                 const gchar  *filename,
+                 const gchar  *what)
+{
+  const int saved_errno = errno;
+
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "Error %s `%s': %s", what, filename,
+               g_strerror (saved_errno));
+  return FALSE;
+}
+
+
+/** Replace the last @tail bytes of @filename with @json.  Returns
+    FALSE with @error unset if the file is too short to have been
+    written by us, so that the caller can write it afresh. */
+static gboolean
+replace_tail (const gchar    *filename,
+              const GString  *json,
+              gsize           tail,
+              GError        **error)
+{
+  FILE *file;
+  long size;
+  gboolean ok = TRUE;
+
+  file = g_fopen (filename, "r+");
+  if (!file)
+    {
+      return errno == ENOENT
+        ? FALSE : set_errno_error (error, filename, "opening");
+    }
+
+  if (fseek (file, 0, SEEK_END) != 0
+      || (size = ftell (file)) < 0)
+    {
+      ok = set_errno_error (error, filename, "seeking in");
+    }
+  else if ((gsize)size < tail)
+    {
+      ok = FALSE;
+    }
+  else if (fseek (file, size - (long)tail, SEEK_SET) != 0
+           || fwrite (json->str, 1, json->len, file) != json->len
+           || fflush (file) != 0
+           || ftruncate (fileno (file), size - (long)tail + json->len) != 0)
+    {
+      ok = set_errno_error (error, filename, "writing to");
+    }
+
+  fclose (file);
+  return ok;
+}
+
+
+/** Build the JSON for the events since the last flush, either as a
+    whole file or, when @append, to follow the events already written
+    in place of the last closing part.  @footer_start is set to where
+    the closing part begins. */
+static GString *
+build_json (gboolean  append,
+            gsize    *footer_start)
+{
+  GString *json;
+  const pid_t pid = getpid ();
+  const guint64 before = append ? flushed_events : 0;
+  guint i;
+
+  json = g_string_sized_new (128 + n_events * 112);
+  if (!append)
+    {
+      g_string_append (json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    }
+
+  for (i = 0; i < n_events; ++i)
+    {
+      const struct trace_event *event = &events[i];
+
+      g_string_append_printf (json,
+                              "%s\n{\"ph\":\"%c\",\"cat\":\"%s\","
+                              "\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                              "\"ts\":%" G_GINT64_FORMAT,
+                              before + i > 0 ? "," : "",
+                              event->phase, event->category,
+                              event->name, (int)pid, (int)pid,
+                              event->ts);
+
+      switch (event->phase)
+        {
+        case 'X':
+          g_string_append_printf (json, ",\"dur\":%" G_GINT64_FORMAT,
+                                  event->dur);
+          break;
+        case 'b':
+        case 'e':
+          g_string_append_printf (json,
+                                  ",\"id\":\"0x%" G_GINT64_MODIFIER "x\"",
+                                  event->id);
+          break;
+        case 'i':
+          g_string_append (json, ",\"s\":\"p\"");
+          break;
+        }
+
+      g_string_append_c (json, '}');
+    }
+
+  *footer_start = json->len;
+  g_string_append_printf (json,
+                          "],\"otherData\":{\"dropped\":\"%"
+                          G_GUINT64_FORMAT "\"}}\n",
+                          (append ? flushed_dropped : 0) + dropped);
+
+  return json;
+}
+
+
+/**
+ * wys_trace_flush:
+ * @filename: Where to write the trace.
+ * @error: Return location for a #GError.
+ *
+ * Write the events recorded since the last flush to @filename as
+ * Chrome trace-event JSON, which chrome://tracing and Perfetto can
+ * open, and empty the buffer.  If the last flush wrote the same file,
+ * the events are added to the ones already in it and the file stays
+ * valid JSON; otherwise the file is written afresh.
+ *
+ * Returns: Whether the trace was written.
+ */
+gboolean
+wys_trace_flush (const gchar  *filename,
+                 GError      **error)
+{
+  GString *json;
+  gboolean append;
+  gboolean ok = FALSE;
+  gsize footer_start;
+  GError *tail_error = NULL;
+
+  g_return_val_if_fail (events != NULL, FALSE);
+
+  append = (g_strcmp0 (flushed_file, filename) == 0);
+  json = build_json (append, &footer_start);
+
+  if (append)
+    {
+      ok = replace_tail (filename, json, footer_len, &tail_error);
+      if (tail_error)
+        {
+          g_propagate_error (error, tail_error);
+          g_string_free (json, TRUE);
+          return FALSE;
+        }
+      else if (!ok)
+        {
+          /* The file isn't the one we wrote; start a new one */
+          g_string_free (json, TRUE);
+          append = FALSE;
+          json = build_json (append, &footer_start);
+        }
+    }
+
+  if (!append)
+    {
+      ok = g_file_set_contents (filename, json->str, json->len, error);
+    }
+
+  if (ok)
+    {
+      if (!append)
+        {
+          g_free (flushed_file);
+          flushed_file = g_strdup (filename);
+          flushed_events = flushed_dropped = 0;
+        }
+
+      footer_len = json->len - footer_start;
+      flushed_events += n_events;
+      flushed_dropped += dropped;
+      n_events = dropped = 0;
+    }
+
+  g_string_free (json, TRUE);
+  return ok;
+}
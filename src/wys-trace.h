@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is part of Wys.
+ *
+ * Wys is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wys is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wys.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#ifndef WYS_TRACE_H__
+#define WYS_TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** Make an async event ID out of a pointer */
+#define WYS_TRACE_ID(p) ((guint64)GPOINTER_TO_SIZE (p))
+
+gboolean wys_trace_start       (guint         capacity);
+void     wys_trace_stop        (void);
+gboolean wys_trace_flush       (const gchar  *filename,
+                                GError      **error);
+void     wys_trace_instant     (const gchar  *category,
+                                const gchar  *name);
+void     wys_trace_async_begin (const gchar  *category,
+                                const gchar  *name,
+                                guint64       id);
+void     wys_trace_async_end   (const gchar  *category,
+                                const gchar  *name,
+                                guint64       id);
+void     wys_trace_complete    (const gchar  *category,
+                                const gchar  *name,
+                                gint64        start,
+                                gint64        end);
+
+G_END_DECLS
+
+#endif /* WYS_TRACE_H__ */